@@ -56,15 +56,22 @@ static int scull_s_open(struct inode *inode, struct file *filp)
 	}
 
 	/* then, everything else is copied from the bare scull device */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY)
+	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		down_write(&dev->rwsem);
 		scull_trim(dev);
-	filp->private_data = dev;
+		up_write(&dev->rwsem);
+	}
+	if (scull_open_file(filp, dev)) {
+		atomic_inc(&scull_s_available); /* give the device back */
+		return -ENOMEM;
+	}
 	return 0;          /* success */
 }
 
 static int scull_s_release(struct inode *inode, struct file *filp)
 {
 	atomic_inc(&scull_s_available); /* release the device */
+	kfree(filp->private_data);
 	return 0;
 }
 
@@ -74,9 +81,9 @@ static int scull_s_release(struct inode *inode, struct file *filp)
 struct file_operations scull_sngl_fops = {
 	.owner =	THIS_MODULE,
 	.llseek =     	scull_llseek,
-	.read =       	scull_read,
-	.write =      	scull_write,
-	.unlocked_ioctl =      	scull_ioctl,
+	.read_iter =  	scull_read_iter,
+	.write_iter = 	scull_write_iter,
+	.unlocked_ioctl =      	scull_dev_ioctl,
 	.open =       	scull_s_open,
 	.release =    	scull_s_release,
 };
@@ -112,9 +119,17 @@ static int scull_u_open(struct inode *inode, struct file *filp)
 
 	/* then, everything else is copied from the bare scull device */
 
-	if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
+	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		down_write(&dev->rwsem);
 		scull_trim(dev);
-	filp->private_data = dev;
+		up_write(&dev->rwsem);
+	}
+	if (scull_open_file(filp, dev)) {
+		spin_lock(&scull_u_lock);
+		scull_u_count--; /* give the device back */
+		spin_unlock(&scull_u_lock);
+		return -ENOMEM;
+	}
 	return 0;          /* success */
 }
 
@@ -123,6 +138,7 @@ static int scull_u_release(struct inode *inode, struct file *filp)
 	spin_lock(&scull_u_lock);
 	scull_u_count--; /* nothing else */
 	spin_unlock(&scull_u_lock);
+	kfree(filp->private_data);
 	return 0;
 }
 
@@ -132,9 +148,9 @@ static int scull_u_release(struct inode *inode, struct file *filp)
 struct file_operations scull_user_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
-	.unlocked_ioctl =      scull_ioctl,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
+	.unlocked_ioctl =      scull_dev_ioctl,
 	.open =       scull_u_open,
 	.release =    scull_u_release,
 };
@@ -160,6 +176,7 @@ static inline int scull_w_available(void)
 static int scull_w_open(struct inode *inode, struct file *filp)
 {
 	struct scull_dev *dev = &scull_w_device; /* device information */
+	int temp;
 
 	spin_lock(&scull_w_lock);
 	while (! scull_w_available()) {
@@ -175,9 +192,19 @@ static int scull_w_open(struct inode *inode, struct file *filp)
 	spin_unlock(&scull_w_lock);
 
 	/* then, everything else is copied from the bare scull device */
-	if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
+	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		down_write(&dev->rwsem);
 		scull_trim(dev);
-	filp->private_data = dev;
+		up_write(&dev->rwsem);
+	}
+	if (scull_open_file(filp, dev)) {
+		spin_lock(&scull_w_lock);
+		temp = --scull_w_count; /* give the device back */
+		spin_unlock(&scull_w_lock);
+		if (temp == 0)
+			wake_up_interruptible_sync(&scull_w_wait);
+		return -ENOMEM;
+	}
 	return 0;          /* success */
 }
 
@@ -192,6 +219,7 @@ static int scull_w_release(struct inode *inode, struct file *filp)
 
 	if (temp == 0)
 		wake_up_interruptible_sync(&scull_w_wait); /* awake other uid's */
+	kfree(filp->private_data);
 	return 0;
 }
 
@@ -202,9 +230,9 @@ static int scull_w_release(struct inode *inode, struct file *filp)
 struct file_operations scull_wusr_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
-	.unlocked_ioctl =      scull_ioctl,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
+	.unlocked_ioctl =      scull_dev_ioctl,
 	.open =       scull_w_open,
 	.release =    scull_w_release,
 };
@@ -248,8 +276,10 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
 
 	/* initialize the device */
 	lptr->key = key;
-	scull_trim(&(lptr->device)); /* initialize it */
-	mutex_init(&(lptr->device.mutex));
+	if (scull_dev_init(&(lptr->device))) {
+		kfree(lptr);
+		return NULL;
+	}
 
 	/* place it in the list */
 	list_add(&lptr->list, &scull_c_list);
@@ -277,9 +307,13 @@ static int scull_c_open(struct inode *inode, struct file *filp)
 		return -ENOMEM;
 
 	/* then, everything else is copied from the bare scull device */
-	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY)
+	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		down_write(&dev->rwsem);
 		scull_trim(dev);
-	filp->private_data = dev;
+		up_write(&dev->rwsem);
+	}
+	if (scull_open_file(filp, dev))
+		return -ENOMEM;
 	return 0;          /* success */
 }
 
@@ -289,6 +323,7 @@ static int scull_c_release(struct inode *inode, struct file *filp)
 	 * Nothing to do, because the device is persistent.
 	 * A `real' cloned device should be freed on last close
 	 */
+	kfree(filp->private_data);
 	return 0;
 }
 
@@ -298,9 +333,9 @@ static int scull_c_release(struct inode *inode, struct file *filp)
 struct file_operations scull_priv_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
-	.unlocked_ioctl =    scull_ioctl,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
+	.unlocked_ioctl =    scull_dev_ioctl,
 	.open =     scull_c_open,
 	.release =  scull_c_release,
 };
@@ -329,9 +364,11 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	int err;
 
 	/* Initialize the device structure */
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
-	mutex_init(&dev->mutex);
+	err = scull_dev_init(dev);
+	if (err) {
+		printk(KERN_NOTICE "Error %d setting up %s\n", err, devinfo->name);
+		return;
+	}
 
 	/* Do the cdev stuff. */
 	cdev_init(&dev->cdev, devinfo->fops);
@@ -378,14 +415,16 @@ void scull_access_cleanup(void)
 	/* Clean up the static devs */
 	for (i = 0; i < SCULL_N_ADEVS; i++) {
 		struct scull_dev *dev = scull_access_devs[i].sculldev;
+		if (!dev->qsets)
+			continue; /* never set up */
 		cdev_del(&dev->cdev);
-		scull_trim(scull_access_devs[i].sculldev);
+		scull_dev_cleanup(dev);
 	}
 
     	/* And all the cloned devices */
 	list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
 		list_del(&lptr->list);
-		scull_trim(&(lptr->device));
+		scull_dev_cleanup(&(lptr->device));
 		kfree(lptr);
 	}
 
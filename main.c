@@ -27,6 +27,13 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/uio.h>		/* iov_iter */
+#include <linux/eventfd.h>
+#include <linux/mm.h>		/* mmap */
+#include <linux/workqueue.h>
+#include <linux/log2.h>		/* roundup_pow_of_two() */
+#include <linux/hashtable.h>
+#include <linux/file.h>		/* fdget() */
 
 #include <asm/uaccess.h>	/* copy_*_user */
 
@@ -40,42 +47,369 @@ int scull_minor =   0;
 int scull_nr_devs = SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =    SCULL_QSET;
+int scull_pool =    SCULL_POOL;	/* spare quanta kept per device */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_pool, int, S_IRUGO);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
 
+static struct kmem_cache *scull_qset_cache;	/* struct scull_qset nodes */
+static struct kmem_cache *scull_quantum_cache;	/* quanta of the load-time size */
+static int scull_quantum_size;			/* ...which is this */
+
 /*
- * Empty out the scull device; must be called with the device
- * mutex held.
+ * Get a quantum for dev, a spare one if it has any. The memory is not
+ * zeroed, and may still hold what was written there before the trim.
  */
-int scull_trim(struct scull_dev *dev)
+static void *scull_quantum_get(struct scull_dev *dev)
+{
+	void *q = dev->pool;
+
+	if (q) {
+		dev->pool = *(void **)q;
+		dev->npool--;
+		return q;
+	}
+	if (dev->quantum == PAGE_SIZE) /* whole pages, which can be mapped */
+		return (void *)__get_free_page(GFP_KERNEL);
+	if (dev->quantum == scull_quantum_size)
+		return kmem_cache_alloc(scull_quantum_cache, GFP_KERNEL);
+	return kvmalloc(dev->quantum, GFP_KERNEL); /* auto mode's may be big */
+}
+
+static void scull_quantum_free(int quantum, void *q)
+{
+	if (quantum == PAGE_SIZE)
+		free_page((unsigned long)q);
+	else if (quantum == scull_quantum_size)
+		kmem_cache_free(scull_quantum_cache, q);
+	else
+		kvfree(q);
+}
+
+/*
+ * Quanta shared by snapshots. A quantum in here is held by count qsets,
+ * two or more; one that isn't has a single owner. Only devices with cow
+ * set, those that have been snapshotted or are snapshots, look here.
+ */
+struct scull_share {
+	struct hlist_node node;
+	void *q;
+	unsigned int count;
+};
+
+static DEFINE_HASHTABLE(scull_shared, 10);
+static DEFINE_SPINLOCK(scull_shared_lock);
+
+static struct scull_share *scull_share_find(void *q)
+{
+	struct scull_share *sh;
+
+	hash_for_each_possible(scull_shared, sh, node, (unsigned long)q)
+		if (sh->q == q)
+			return sh;
+	return NULL;
+}
+
+/* Add a holder to q, using sh (allocated by the caller) if it's the second */
+static void scull_quantum_share(void *q, struct scull_share *sh)
+{
+	struct scull_share *old;
+
+	spin_lock(&scull_shared_lock);
+	old = scull_share_find(q);
+	if (old) {
+		old->count++;
+	} else {
+		sh->q = q;
+		sh->count = 2;
+		hash_add(scull_shared, &sh->node, (unsigned long)q);
+		sh = NULL;
+	}
+	spin_unlock(&scull_shared_lock);
+	kfree(sh);
+}
+
+static bool scull_quantum_shared(void *q)
+{
+	bool shared;
+
+	spin_lock(&scull_shared_lock);
+	shared = scull_share_find(q) != NULL;
+	spin_unlock(&scull_shared_lock);
+	return shared;
+}
+
+/*
+ * Let go of q: true if others still hold it, and it must be left alone,
+ * false if the caller was its only owner after all, and is to free it.
+ */
+static bool scull_quantum_unshare(void *q)
 {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
+	struct scull_share *sh;
+	bool shared = false;
+
+	spin_lock(&scull_shared_lock);
+	sh = scull_share_find(q);
+	if (sh) {
+		shared = true;
+		if (--sh->count == 1)
+			hash_del(&sh->node); /* the last one left owns it alone */
+		else
+			sh = NULL;
+	}
+	spin_unlock(&scull_shared_lock);
+	kfree(sh);
+	return shared;
+}
+
+/* Give a quantum back, keeping it as a spare while the pool has room */
+static void scull_quantum_put(struct scull_dev *dev, void *q)
+{
+	if (!q)
+		return;
+	if (dev->cow && scull_quantum_unshare(q))
+		return; /* a snapshot still has it */
+	if (dev->npool < scull_pool && dev->quantum >= sizeof(void *) &&
+			(unsigned long)dev->npool * dev->quantum < SCULL_POOL_BYTES) {
+		*(void **)q = dev->pool;
+		dev->pool = q;
+		dev->npool++;
+	} else {
+		scull_quantum_free(dev->quantum, q);
+	}
+}
+
+/*
+ * Free the spare quanta of dev; they are all dev->quantum bytes long.
+ * Called by scull_trim when the quantum changes, and before the device
+ * goes away.
+ */
+void scull_drain_pool(struct scull_dev *dev)
+{
+	void *q;
+
+	while ((q = dev->pool)) {
+		dev->pool = *(void **)q;
+		scull_quantum_free(dev->quantum, q);
+	}
+	dev->npool = 0;
+}
+
+/*
+ * Free a whole tree of quantum sets, quantum and qset being the geometry
+ * they were made with, and cow whether they may share quanta.
+ */
+static void scull_free_qsets(struct radix_tree_root *qsets, int quantum,
+		int qset, bool cow)
+{
+	struct scull_qset *dptr;
+	struct radix_tree_iter iter;
+	void **slot;
 	int i;
 
-	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
+	radix_tree_for_each_slot(slot, qsets, &iter, 0) { /* all the items */
+		dptr = radix_tree_deref_slot(slot);
 		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
+			for (i = 0; i < qset; i++) {
+				if (!dptr->data[i])
+					continue;
+				if (cow && scull_quantum_unshare(dptr->data[i]))
+					continue;
+				scull_quantum_free(quantum, dptr->data[i]);
+			}
 			kfree(dptr->data);
-			dptr->data = NULL;
 		}
-		next = dptr->next;
-		kfree(dptr);
+		radix_tree_iter_delete(qsets, &iter, slot);
+		kmem_cache_free(scull_qset_cache, dptr);
+		cond_resched();
 	}
+}
+
+/*
+ * Where the tree of a device lives. Radix tree nodes point back at their
+ * root, so a tree can't be moved to another one: a trim instead hands the
+ * whole holder over to scull_trim_wq, along with the geometry needed to
+ * free it, and gives the device a fresh one. This costs the same however
+ * much there is in there.
+ */
+struct scull_tree {
+	struct radix_tree_root root;
+	int quantum, qset;
+	bool cow;
+	struct work_struct work;
+};
+
+static struct workqueue_struct *scull_trim_wq;
+
+static void scull_trim_work(struct work_struct *work)
+{
+	struct scull_tree *t = container_of(work, struct scull_tree, work);
+
+	scull_free_qsets(&t->root, t->quantum, t->qset, t->cow);
+	kfree(t);
+}
+
+static struct scull_tree *scull_tree_alloc(void)
+{
+	struct scull_tree *t = kmalloc(sizeof(struct scull_tree), GFP_KERNEL);
+
+	if (t) {
+		INIT_RADIX_TREE(&t->root, GFP_KERNEL);
+		INIT_WORK(&t->work, scull_trim_work);
+	}
+	return t;
+}
+
+/*
+ * Before the data of dev goes, take spares for its pool out of it. Only
+ * the first couple of qsets are looked at, so this stays cheap however
+ * big and sparse the device is.
+ */
+static void scull_refill_pool(struct scull_dev *dev)
+{
+	struct scull_qset *dptr;
+	struct radix_tree_iter iter;
+	void **slot;
+	int i, looked = 0;
+
+	radix_tree_for_each_slot(slot, dev->qsets, &iter, 0) {
+		if (dev->npool >= scull_pool || looked++ == 2)
+			break;
+		dptr = radix_tree_deref_slot(slot);
+		for (i = 0; dptr->data && i < dev->qset; i++) {
+			if (!dptr->data[i])
+				continue;
+			if (dev->npool >= scull_pool)
+				break;
+			scull_quantum_put(dev, dptr->data[i]);
+			dptr->data[i] = NULL;
+		}
+	}
+}
+
+/* The quantum auto mode picks; see SCULL_AUTO_QUANTA */
+static int scull_auto_quantum(struct scull_dev *dev)
+{
+	unsigned long want;
+
+	if (!dev->nwrites)
+		return dev->quantum ? dev->quantum : SCULL_QUANTUM; /* no clue */
+	want = max(dev->wbytes / dev->nwrites, dev->size / SCULL_AUTO_QUANTA);
+	if (want <= SCULL_QUANTUM)
+		return SCULL_QUANTUM;
+	if (want >= SCULL_AUTO_MAX)
+		return SCULL_AUTO_MAX;
+	return roundup_pow_of_two(want);
+}
+
+/*
+ * Empty out the scull device, and switch it to the geometry it should
+ * have from now on; must be called with the device rwsem held for writing.
+ */
+int scull_trim(struct scull_dev *dev)
+{
+	struct scull_tree *t, *old;
+	int quantum, qset;
+
+	/* mapped quanta can't be taken away; see scull_mmap */
+	mutex_lock(&dev->map_mutex);
+	if (atomic_read(&dev->vmas)) {
+		mutex_unlock(&dev->map_mutex);
+		return -EBUSY;
+	}
+
+	if (dev->want_quantum == SCULL_QUANTUM_AUTO)
+		quantum = scull_auto_quantum(dev);
+	else
+		quantum = dev->want_quantum ? dev->want_quantum : scull_quantum;
+	qset = dev->want_qset ? dev->want_qset : scull_qset;
+	if (quantum > 0 && qset > INT_MAX / quantum)
+		qset = INT_MAX / quantum; /* itemsize is an int */
+
+	if (dev->quantum != quantum)
+		scull_drain_pool(dev); /* the spares are the wrong size now */
+	else
+		scull_refill_pool(dev);
+
+	if (!radix_tree_empty(dev->qsets)) {
+		t = scull_tree_alloc();
+		if (t) {
+			old = container_of(dev->qsets, struct scull_tree, root);
+			old->quantum = dev->quantum;
+			old->qset = dev->qset;
+			old->cow = dev->cow;
+			queue_work(scull_trim_wq, &old->work);
+			dev->qsets = &t->root;
+		} else {
+			scull_free_qsets(dev->qsets, dev->quantum, dev->qset,
+					dev->cow);
+		}
+	}
+	dev->cow = false; /* nothing left to share */
 	dev->size = 0;
+	dev->wbytes = dev->nwrites = 0;
+	dev->gen++; /* cached cursors now point to freed qsets */
+	dev->quantum = quantum;
+	dev->qset = qset;
+	mutex_unlock(&dev->map_mutex);
+	return 0;
+}
+
+/*
+ * Set up a zeroed scull device, all but its cdev, with the default
+ * geometry; undone by scull_dev_cleanup.
+ */
+int scull_dev_init(struct scull_dev *dev)
+{
+	struct scull_tree *t = scull_tree_alloc();
+
+	if (!t)
+		return -ENOMEM;
+	dev->qsets = &t->root;
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
-	dev->data = NULL;
+	init_rwsem(&dev->rwsem);
+	mutex_init(&dev->map_mutex);
+	return 0;
+}
+
+/* Free all a device holds, right away; fine if it was never set up */
+void scull_dev_cleanup(struct scull_dev *dev)
+{
+	if (!dev->qsets)
+		return;
+	scull_free_qsets(dev->qsets, dev->quantum, dev->qset, dev->cow);
+	kfree(container_of(dev->qsets, struct scull_tree, root));
+	dev->qsets = NULL;
+	scull_drain_pool(dev);
+}
+
+/*
+ * Swap in the eventfd behind fd for readiness notification, dropping the
+ * one there was; a negative fd only drops it. The caller holds whatever
+ * lock the device signals *ctxp under.
+ */
+int scull_set_eventfd(struct eventfd_ctx **ctxp, int fd)
+{
+	struct eventfd_ctx *ctx = NULL;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+	if (*ctxp)
+		eventfd_ctx_put(*ctxp);
+	*ctxp = ctx;
 	return 0;
 }
 #ifdef SCULL_DEBUG
@@ -87,26 +421,31 @@ static int scull_read_mem_proc_show(struct seq_file *m, void *v)
 {
 	int i, j;
 	int limit = m->size - 80; /* Don't print more than this */
+	struct radix_tree_iter iter;
+	void **slot;
 
 	for (i = 0; i < scull_nr_devs && m->count <= limit; i++) {
 		struct scull_dev *d = &scull_devices[i];
-		struct scull_qset *qs = d->data;
-		if (mutex_lock_interruptible(&d->mutex))
+		struct scull_qset *qs = NULL;
+		if (down_read_killable(&d->rwsem))
 			return -ERESTARTSYS;
 		seq_printf(m,"\nDevice %i: qset %i, q %i, sz %li\n",
 				i, d->qset, d->quantum, d->size);
-		for (; qs && m->count <= limit; qs = qs->next) { /* scan the list */
-			seq_printf(m, "  item at %p, qset at %p\n",
-					qs, qs->data);
-			if (qs->data && !qs->next) /* dump only the last item */
-				for (j = 0; j < d->qset; j++) {
-					if (qs->data[j])
-						seq_printf(m,
-								"    % 4i: %8p\n",
-								j, qs->data[j]);
-				}
+		radix_tree_for_each_slot(slot, d->qsets, &iter, 0) { /* scan the tree */
+			if (m->count > limit)
+				break;
+			qs = radix_tree_deref_slot(slot);
+			seq_printf(m, "  item %lu at %p, qset at %p\n",
+					qs->index, qs, qs->data);
 		}
-		mutex_unlock(&scull_devices[i].mutex);
+		if (qs && qs->data) /* dump only the last item */
+			for (j = 0; j < d->qset; j++) {
+				if (qs->data[j])
+					seq_printf(m,
+							"    % 4i: %8p\n",
+							j, qs->data[j]);
+			}
+		up_read(&scull_devices[i].rwsem);
 	}
 	return 0;
 }
@@ -143,24 +482,28 @@ static void scull_seq_stop(struct seq_file *s, void *v)
 static int scull_seq_show(struct seq_file *s, void *v)
 {
 	struct scull_dev *dev = (struct scull_dev *) v;
-	struct scull_qset *d;
+	struct scull_qset *d = NULL;
+	struct radix_tree_iter iter;
+	void **slot;
 	int i;
 
-	if (mutex_lock_interruptible(&dev->mutex))
+	if (down_read_killable(&dev->rwsem))
 		return -ERESTARTSYS;
 	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
 			(int) (dev - scull_devices), dev->qset,
 			dev->quantum, dev->size);
-	for (d = dev->data; d; d = d->next) { /* scan the list */
-		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
-		if (d->data && !d->next) /* dump only the last item */
-			for (i = 0; i < dev->qset; i++) {
-				if (d->data[i])
-					seq_printf(s, "    % 4i: %8p\n",
-							i, d->data[i]);
-			}
+	radix_tree_for_each_slot(slot, dev->qsets, &iter, 0) { /* scan the tree */
+		d = radix_tree_deref_slot(slot);
+		seq_printf(s, "  item %lu at %p, qset at %p\n",
+				d->index, d, d->data);
 	}
-	mutex_unlock(&dev->mutex);
+	if (d && d->data) /* dump only the last item */
+		for (i = 0; i < dev->qset; i++) {
+			if (d->data[i])
+				seq_printf(s, "    % 4i: %8p\n",
+						i, d->data[i]);
+		}
+	up_read(&dev->rwsem);
 	return 0;
 }
 	
@@ -237,157 +580,498 @@ static void scull_remove_proc(void)
  * Open and close
  */
 
+/*
+ * Hang the per-open state off filp, for the bare devices and the
+ * access ones alike; their release methods free it.
+ */
+int scull_open_file(struct file *filp, struct scull_dev *dev)
+{
+	struct scull_file *sf;
+
+	sf = kzalloc(sizeof(struct scull_file), GFP_KERNEL);
+	if (!sf)
+		return -ENOMEM;
+	sf->dev = dev;
+	filp->private_data = sf; /* for other methods */
+	filp->f_mode |= FMODE_NOWAIT; /* read_iter and write_iter honor it */
+	return 0;
+}
+
 int scull_open(struct inode *inode, struct file *filp)
 {
 	struct scull_dev *dev; /* device information */
+	int retval;
 
 	dev = container_of(inode->i_cdev, struct scull_dev, cdev);
-	filp->private_data = dev; /* for other methods */
+	retval = scull_open_file(filp, dev);
+	if (retval)
+		return retval;
 
 	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (mutex_lock_interruptible(&dev->mutex))
+		if (down_write_killable(&dev->rwsem)) {
+			kfree(filp->private_data);
 			return -ERESTARTSYS;
+		}
 		scull_trim(dev); /* ignore errors */
-		mutex_unlock(&dev->mutex);
+		up_write(&dev->rwsem);
 	}
 	return 0;          /* success */
 }
 
 int scull_release(struct inode *inode, struct file *filp)
 {
+	kfree(filp->private_data);
 	return 0;
 }
 
 /*
- * Follow the list
+ * Look quantum set n up, and add it to the tree if it is missing and
+ * create is set. The file's cursor is tried before the tree, and left
+ * on whatever was found. Called with the device rwsem held, for writing
+ * if create is set. Readers of one file sharing the rwsem may race on
+ * its cursor, which is harmless: trims are excluded, so whatever any of
+ * them leaves there is valid for the current generation.
  */
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+struct scull_qset *scull_follow(struct scull_file *sf, unsigned long n,
+		bool create)
 {
-	struct scull_qset *qs = dev->data;
+	struct scull_dev *dev = sf->dev;
+	struct scull_qset *qs = READ_ONCE(sf->qs);
 
-        /* Allocate first qset explicitly if need be */
-	if (! qs) {
-		qs = dev->data = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
+	if (qs && READ_ONCE(sf->gen) == dev->gen && qs->index == n)
+		return qs;    /* sequential access stays in here */
+
+	qs = radix_tree_lookup(dev->qsets, n);
+	if (!qs && create) {
+		qs = kmem_cache_zalloc(scull_qset_cache, GFP_KERNEL);
 		if (qs == NULL)
 			return NULL;  /* Never mind */
-	}
-
-	/* Then follow the list */
-	while (n--) {
-		if (!qs->next) {
-			qs->next = kzalloc(sizeof(struct scull_qset), GFP_KERNEL);
-			if (qs->next == NULL)
-				return NULL;  /* Never mind */
+		qs->index = n;
+		if (radix_tree_insert(dev->qsets, n, qs)) {
+			kmem_cache_free(scull_qset_cache, qs);
+			return NULL;
 		}
-		qs = qs->next;
-		continue;
+	}
+	if (qs) {
+		WRITE_ONCE(sf->qs, qs);
+		WRITE_ONCE(sf->gen, dev->gen);
 	}
 	return qs;
 }
 
 /*
- * Data management: read and write
+ * Quantum s of dptr, to be written to: if it is shared with a snapshot,
+ * it's replaced with a copy of its own first. NULL if out of memory.
  */
+static void *scull_quantum_private(struct scull_dev *dev,
+		struct scull_qset *dptr, int s)
+{
+	void *q = dptr->data[s], *copy;
+
+	if (!q || !dev->cow || !scull_quantum_shared(q))
+		return q;
+	copy = scull_quantum_get(dev);
+	if (!copy)
+		return NULL;
+	memcpy(copy, q, dev->quantum);
+	smp_store_release(&dptr->data[s], copy);
+	if (!scull_quantum_unshare(q))
+		scull_quantum_free(dev->quantum, q); /* the snapshot went first */
+	return copy;
+}
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/* The quantum pointers of a qset, allocated if need be */
+static void **scull_qset_data(struct scull_qset *dptr, int qset)
 {
-	struct scull_dev *dev = filp->private_data; 
-	struct scull_qset *dptr;	/* the first listitem */
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
+	void **data = dptr->data;
 
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
+	if (!data) {
+		data = kzalloc(qset * sizeof(char *), GFP_KERNEL);
+		if (data)
+			smp_store_release(&dptr->data, data); /* see scull_vma_fault */
+	}
+	return data;
+}
+
+/*
+ * Data management: read and write
+ */
+
+/*
+ * Both work on a whole iov_iter, so the segments of a readv() or writev()
+ * are all handled under a single acquisition of the device lock, and go on
+ * from one quantum to the next until the request is done. Holes below
+ * the size of the device read as zeros. Reads only
+ * take the lock shared, so any number of them run at once; a write
+ * holds it alone, as it may add quanta to the tree.
+ */
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scull_file *sf = iocb->ki_filp->private_data;
+	struct scull_dev *dev = sf->dev; 
+	struct scull_qset *dptr;	/* the item holding f_pos */
+	int quantum, qset, itemsize; /* itemsize: how many bytes in the item */
+	long item;
+	int s_pos, q_pos, rest;
+	size_t count = iov_iter_count(to), chunk, copied;
+	loff_t *f_pos = &iocb->ki_pos;
+	ssize_t retval;
+
+	retval = scull_down_iocb(&dev->rwsem, iocb, false);
+	if (retval)
+		return retval;
+	quantum = dev->quantum; /* the geometry only changes under the lock */
+	qset = dev->qset;
+	itemsize = quantum * qset;
 	if (*f_pos >= dev->size)
 		goto out;
 	if (*f_pos + count > dev->size)
 		count = dev->size - *f_pos;
 
-	/* find listitem, qset index, and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scull_follow(dev, item);
-
-	if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-		goto out; /* don't fill holes */
+	while (count) {
+		/* find item, qset index, and offset in the quantum */
+		item = (long)*f_pos / itemsize;
+		rest = (long)*f_pos % itemsize;
+		s_pos = rest / quantum; q_pos = rest % quantum;
+
+		/* look the item up, wherever it is (defined elsewhere) */
+		dptr = scull_follow(sf, item, false);
+
+		/* read up to the end of this quantum, then go on to the next */
+		chunk = min_t(size_t, count, quantum - q_pos);
+		if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
+			copied = iov_iter_zero(chunk, to); /* don't fill holes */
+		else
+			copied = copy_to_iter(dptr->data[s_pos] + q_pos, chunk, to);
+		*f_pos += copied;
+		retval += copied;
+		count -= copied;
+		if (copied < chunk) {
+			if (!retval)
+				retval = -EFAULT;
+			break;
+		}
+	}
 
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+  out:
+	up_read(&dev->rwsem);
+	return retval;
+}
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scull_file *sf = iocb->ki_filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	struct scull_qset *dptr;
+	int quantum, qset, itemsize;
+	long item;
+	int s_pos, q_pos, rest;
+	size_t count = iov_iter_count(from), chunk, copied;
+	loff_t *f_pos = &iocb->ki_pos;
+	ssize_t retval;
+	int err = 0;
+	bool fresh;
+	void *q;
+
+	retval = scull_down_iocb(&dev->rwsem, iocb, true);
+	if (retval)
+		return retval;
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = quantum * qset;
+
+	while (count) {
+		/* find item, qset index and offset in the quantum */
+		item = (long)*f_pos / itemsize;
+		rest = (long)*f_pos % itemsize;
+		s_pos = rest / quantum;
+		q_pos = rest % quantum;
+
+		/* look the item up, making it if need be */
+		err = -ENOMEM; /* value used by the breaks below */
+		dptr = scull_follow(sf, item, true);
+		if (dptr == NULL)
+			break;
+		if (!scull_qset_data(dptr, qset))
+			break;
+
+		/* write up to the end of this quantum, then go on to the next */
+		chunk = min_t(size_t, count, quantum - q_pos);
+		fresh = !dptr->data[s_pos];
+		if (!fresh) {
+			q = scull_quantum_private(dev, dptr, s_pos);
+			if (!q)
+				break;
+		} else {
+			q = scull_quantum_get(dev);
+			if (!q)
+				break;
+			/* a new quantum holds stale data, and userspace could seek
+			 * and read it: zero what this write doesn't cover, which is
+			 * nothing at all when it fills the whole quantum */
+			memset(q, 0, q_pos);
+			memset(q + q_pos + chunk, 0, quantum - q_pos - chunk);
+		}
+		err = 0;
+
+		copied = copy_from_iter(q + q_pos, chunk, from);
+		if (fresh) {
+			if (copied < chunk)
+				memset(q + q_pos + copied, 0, chunk - copied);
+			/* only now may a fault on a mapping of the device find it */
+			smp_store_release(&dptr->data[s_pos], q);
+		}
+		*f_pos += copied;
+		retval += copied;
+		count -= copied;
+
+		/* update the size */
+		if (dev->size < *f_pos)
+			dev->size = *f_pos;
+		if (copied < chunk) {
+			err = -EFAULT;
+			break;
+		}
+	}
+	if (!retval)
+		retval = err; /* only fail if nothing at all was written */
+	if (retval > 0) {
+		dev->wbytes += retval;
+		dev->nwrites++;
 	}
-	*f_pos += count;
-	retval = count;
 
-  out:
-	mutex_unlock(&dev->mutex);
+	up_write(&dev->rwsem);
 	return retval;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Sparse files: holes are missing quanta, which SEEK_DATA and SEEK_HOLE
+ * find and the range ioctls make and fill in. All of these are called
+ * with the device rwsem held, for writing if they change anything.
+ */
+
+/* The quantum holding byte pos, or NULL in a hole */
+static void *scull_quantum_at(struct scull_dev *dev, unsigned long pos)
 {
-	struct scull_dev *dev = filp->private_data;
+	unsigned long itemsize = (unsigned long)dev->quantum * dev->qset;
+	struct scull_qset *dptr = radix_tree_lookup(dev->qsets, pos / itemsize);
+
+	if (!dptr || !dptr->data)
+		return NULL;
+	return dptr->data[(pos % itemsize) / dev->quantum];
+}
+
+/* Where SEEK_DATA (data set) or SEEK_HOLE from off ends up */
+static loff_t scull_seek_data(struct scull_dev *dev, loff_t off, bool data)
+{
+	unsigned long quantum = dev->quantum, qset = dev->qset;
+	unsigned long itemsize = quantum * qset, pos;
 	struct scull_qset *dptr;
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
+	struct radix_tree_iter iter;
+	void **slot;
+	int s;
+
+	if (off < 0 || off >= dev->size)
+		return -ENXIO;
+
+	if (!data) {
+		/* there is always one at the end of the device */
+		for (pos = off; pos < dev->size; pos += quantum - pos % quantum)
+			if (!scull_quantum_at(dev, pos))
+				return pos;
+		return dev->size;
+	}
 
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
+	/* the tree skips over the missing qsets for us */
+	radix_tree_for_each_slot(slot, dev->qsets, &iter, off / itemsize) {
+		dptr = radix_tree_deref_slot(slot);
+		for (s = 0; dptr->data && s < qset; s++) {
+			pos = dptr->index * itemsize + s * quantum;
+			if (pos >= dev->size)
+				return -ENXIO;
+			if (dptr->data[s] && pos + quantum > off)
+				return max_t(loff_t, pos, off);
+		}
+	}
+	return -ENXIO;
+}
 
-	/* find listitem, qset index and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum;
-	q_pos = rest % quantum;
+/*
+ * Like scull_quantum_at, but the quantum is made dev's own to be written
+ * to (see scull_quantum_private); *qp is left NULL in a hole.
+ */
+static int scull_quantum_at_private(struct scull_dev *dev, unsigned long pos,
+		void **qp)
+{
+	unsigned long itemsize = (unsigned long)dev->quantum * dev->qset;
+	struct scull_qset *dptr;
+	int s = (pos % itemsize) / dev->quantum;
+
+	*qp = NULL;
+	dptr = radix_tree_lookup(dev->qsets, pos / itemsize);
+	if (!dptr || !dptr->data || !dptr->data[s])
+		return 0;
+	*qp = scull_quantum_private(dev, dptr, s);
+	return *qp ? 0 : -ENOMEM;
+}
 
-	/* follow the list up to the right position */
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL)
-		goto out;
-	if (!dptr->data) {
-		dptr->data = kzalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
-			goto out;
-	}
-	if (!dptr->data[s_pos]) {
-		/* zero memory since there is no guarantee that memory will be
-		 * initialzed before being read by userspace (e.g., user could
-		 * seek and read uninitialized memory) */
-		dptr->data[s_pos] = kzalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
-	}
-	/* write only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
-
-	if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto out;
+/*
+ * Punch a hole: give back the quanta entirely within [start, end), and
+ * the qsets left empty, and zero the rest of the range
+ */
+static int scull_punch(struct scull_dev *dev, unsigned long start,
+		unsigned long end)
+{
+	unsigned long quantum = dev->quantum, qset = dev->qset;
+	unsigned long first = DIV_ROUND_UP(start, quantum); /* whole quanta, */
+	unsigned long last = end / quantum;                 /* [first, last) */
+	unsigned long head_end = min(end, first * quantum);  /* [start, head_end) */
+	unsigned long tail = first > last ? end : max(start, last * quantum);
+	struct scull_qset *dptr;
+	struct radix_tree_iter iter;
+	void **slot, *hq = NULL, *tq = NULL;
+	unsigned long k;
+	int s, left, retval = 0;
+
+	/* mapped quanta can't be taken away; see scull_mmap */
+	mutex_lock(&dev->map_mutex);
+	if (first < last && atomic_read(&dev->vmas)) {
+		mutex_unlock(&dev->map_mutex);
+		return -EBUSY;
+	}
+	/* get hold of the partial quanta at either end before changing any */
+	if (start < head_end)
+		retval = scull_quantum_at_private(dev, start, &hq);
+	if (!retval && tail < end)
+		retval = scull_quantum_at_private(dev, tail, &tq);
+	if (retval) {
+		mutex_unlock(&dev->map_mutex);
+		return retval;
+	}
+	if (hq)
+		memset(hq + start % quantum, 0, head_end - start);
+	if (tq)
+		memset(tq + tail % quantum, 0, end - tail);
+
+	radix_tree_for_each_slot(slot, dev->qsets, &iter, first / qset) {
+		dptr = radix_tree_deref_slot(slot);
+		if (first >= last || dptr->index * qset >= last)
+			break;
+		for (s = 0, left = 0; dptr->data && s < qset; s++) {
+			k = dptr->index * qset + s;
+			if (k >= first && k < last) {
+				scull_quantum_put(dev, dptr->data[s]);
+				dptr->data[s] = NULL;
+			}
+			left += !!dptr->data[s];
+		}
+		if (left)
+			continue;
+		kfree(dptr->data);
+		radix_tree_iter_delete(dev->qsets, &iter, slot);
+		kmem_cache_free(scull_qset_cache, dptr);
+		dev->gen++; /* cached cursors may point to it */
 	}
-	*f_pos += count;
-	retval = count;
+	mutex_unlock(&dev->map_mutex);
+	return 0;
+}
+
+/* Fill in every quantum [start, end) touches with zeros */
+static int scull_prealloc(struct scull_file *sf, unsigned long start,
+		unsigned long end)
+{
+	struct scull_dev *dev = sf->dev;
+	unsigned long quantum = dev->quantum, qset = dev->qset;
+	struct scull_qset *dptr;
+	unsigned long k;
+	void **data, *q;
+
+	for (k = start / quantum; k * quantum < end; k++) {
+		dptr = scull_follow(sf, k / qset, true);
+		if (!dptr)
+			return -ENOMEM;
+		data = scull_qset_data(dptr, qset);
+		if (!data)
+			return -ENOMEM;
+		if (data[k % qset])
+			continue;
+		q = scull_quantum_get(dev);
+		if (!q)
+			return -ENOMEM;
+		memset(q, 0, quantum);
+		smp_store_release(&data[k % qset], q);
+	}
+	return 0;
+}
 
-        /* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
+/*
+ * Make dev a copy of src, sharing its quanta until either side writes
+ * to them. Called with both rwsems held for writing.
+ */
+static int scull_snapshot(struct scull_dev *dev, struct scull_dev *src)
+{
+	struct scull_qset *sptr, *dptr;
+	struct scull_share *sh;
+	struct radix_tree_iter iter;
+	void **slot;
+	int i, retval;
+
+	/* stores through a mapping would skip the copy; see scull_mmap */
+	mutex_lock(&src->map_mutex);
+	retval = atomic_read(&src->vmas) ? -EBUSY : 0;
+	if (!retval)
+		src->cow = true;
+	mutex_unlock(&src->map_mutex);
+	if (!retval)
+		retval = scull_trim(dev);
+	if (retval)
+		return retval;
+	mutex_lock(&dev->map_mutex);
+	retval = atomic_read(&dev->vmas) ? -EBUSY : 0; /* mapped since */
+	if (!retval)
+		dev->cow = true;
+	mutex_unlock(&dev->map_mutex);
+	if (retval)
+		return retval;
+
+	if (dev->quantum != src->quantum)
+		scull_drain_pool(dev);
+	dev->quantum = src->quantum;
+	dev->qset = src->qset;
+
+	radix_tree_for_each_slot(slot, src->qsets, &iter, 0) {
+		sptr = radix_tree_deref_slot(slot);
+		if (!sptr->data)
+			continue;
+		dptr = kmem_cache_zalloc(scull_qset_cache, GFP_KERNEL);
+		if (!dptr)
+			goto nomem;
+		dptr->index = sptr->index;
+		dptr->data = kzalloc(src->qset * sizeof(char *), GFP_KERNEL);
+		if (!dptr->data ||
+				radix_tree_insert(dev->qsets, dptr->index, dptr)) {
+			kfree(dptr->data);
+			kmem_cache_free(scull_qset_cache, dptr);
+			goto nomem;
+		}
+		for (i = 0; i < src->qset; i++) {
+			if (!sptr->data[i])
+				continue;
+			sh = kmalloc(sizeof(struct scull_share), GFP_KERNEL);
+			if (!sh)
+				goto nomem;
+			scull_quantum_share(sptr->data[i], sh);
+			dptr->data[i] = sptr->data[i];
+		}
+		cond_resched();
+	}
+	dev->size = src->size;
+	return 0;
 
-  out:
-	mutex_unlock(&dev->mutex);
-	return retval;
+  nomem:
+	scull_trim(dev); /* gives back what was shared so far */
+	return -ENOMEM;
 }
 
 /*
@@ -516,12 +1200,115 @@ long scull_ioctl(struct file *filp,
 
 }
 
+/*
+ * The ioctl() of the bare devices and those in access.c, which also have
+ * the range commands; everything else is common to all scull devices.
+ */
+long scull_dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+	struct scull_dev *src = NULL, *first, *second;
+	struct scull_range range;
+	struct scull_geometry geo;
+	unsigned long end;
+	struct fd f;
+	long retval;
+
+	switch(cmd) {
+	  case SCULL_IOCTSNAPSHOT:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF; /* its data is about to be replaced */
+		f = fdget(arg);
+		if (!f.file)
+			return -EBADF;
+		if (!(f.file->f_mode & FMODE_READ)) {
+			fdput(f); /* its data is not ours to copy */
+			return -EBADF;
+		}
+		/* any of the devices using scull's own read_iter will do */
+		if (f.file->f_op->read_iter == scull_read_iter)
+			src = ((struct scull_file *)f.file->private_data)->dev;
+		if (!src || src == dev) {
+			fdput(f);
+			return -EINVAL;
+		}
+		/* both exclusive, taken in address order */
+		first = dev < src ? dev : src;
+		second = dev < src ? src : dev;
+		retval = -ERESTARTSYS;
+		if (!down_write_killable(&first->rwsem)) {
+			down_write_nested(&second->rwsem, SINGLE_DEPTH_NESTING);
+			retval = scull_snapshot(dev, src);
+			up_write(&second->rwsem);
+			up_write(&first->rwsem);
+		}
+		fdput(f);
+		return retval;
+
+	  case SCULL_IOCSGEOMETRY:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&geo, (void __user *)arg, sizeof(geo)))
+			return -EFAULT;
+		if ((geo.quantum < 0 && geo.quantum != SCULL_QUANTUM_AUTO) ||
+				geo.quantum > SCULL_AUTO_MAX ||
+				geo.qset < 0 || geo.qset > SCULL_QSET_MAX)
+			return -EINVAL;
+		if (down_write_killable(&dev->rwsem))
+			return -ERESTARTSYS;
+		dev->want_quantum = geo.quantum;
+		dev->want_qset = geo.qset;
+		if (!dev->size && radix_tree_empty(dev->qsets))
+			scull_trim(dev); /* nothing to lose: apply it now */
+		up_write(&dev->rwsem);
+		return 0;
+
+	  case SCULL_IOCGGEOMETRY:
+		if (down_read_killable(&dev->rwsem))
+			return -ERESTARTSYS;
+		geo.quantum = dev->want_quantum;
+		geo.qset = dev->want_qset;
+		geo.cur_quantum = dev->quantum;
+		geo.cur_qset = dev->qset;
+		up_read(&dev->rwsem);
+		return copy_to_user((void __user *)arg, &geo, sizeof(geo)) ?
+			-EFAULT : 0;
+
+	  case SCULL_IOCSPUNCH:
+	  case SCULL_IOCSPREALLOC:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF; /* as for fallocate() */
+		if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+			return -EFAULT;
+		end = range.offset + range.length;
+		if (!range.length || end < range.offset)
+			return -EINVAL;
+		if (cmd == SCULL_IOCSPREALLOC && end > MAX_LFS_FILESIZE)
+			return -EFBIG;
+		if (cmd == SCULL_IOCSPREALLOC && range.length > SCULL_PREALLOC_MAX)
+			return -ENOSPC;
+		if (down_write_killable(&dev->rwsem))
+			return -ERESTARTSYS;
+		if (cmd == SCULL_IOCSPUNCH)
+			retval = scull_punch(dev, range.offset, end);
+		else
+			retval = scull_prealloc(sf, range.offset, end);
+		up_write(&dev->rwsem);
+		return retval;
+
+	  default:
+		return scull_ioctl(filp, cmd, arg);
+	}
+}
+
 /*
  * "extended" operations (only seek)
  */
 loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 {
-	struct scull_dev *dev = filp->private_data;
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
 	loff_t newpos;
 
 	switch(whence) {
@@ -537,6 +1324,16 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 		newpos = dev->size + off;
 		break;
 
+	  case 3: /* SEEK_DATA */
+	  case 4: /* SEEK_HOLE */
+		if (down_read_killable(&dev->rwsem))
+			return -ERESTARTSYS;
+		newpos = scull_seek_data(dev, off, whence == SEEK_DATA);
+		up_read(&dev->rwsem);
+		if (newpos < 0)
+			return newpos;
+		break;
+
 	  default: /* can't happen */
 		return -EINVAL;
 	}
@@ -545,12 +1342,93 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 	return newpos;
 }
 
+/*
+ * mmap, for devices whose quanta are whole pages: set the quantum to
+ * PAGE_SIZE and trim the device (e.g. with a write-only open) first.
+ * Devices sharing quanta with a snapshot can't be mapped until trimmed.
+ * As in scullp, faults map the quantum pages themselves, holes can't
+ * be mapped, and the device is not trimmed while it is mapped anywhere.
+ */
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->vmas);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->vmas);
+}
+
+/*
+ * Faults don't take the device rwsem: the copy in write_iter may fault
+ * on a mapping of this very device while it holds it. Quanta and qsets
+ * are never freed while mapped, the tree can be walked under RCU, and
+ * write_iter publishes new quanta only once they are filled in.
+ */
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
+{
+	struct scull_dev *dev = vmf->vma->vm_private_data;
+	struct scull_qset *dptr;
+	int qset = dev->qset;   /* can't change while mapped */
+	void **data, *q = NULL;
+
+	rcu_read_lock();
+	dptr = radix_tree_lookup(dev->qsets, vmf->pgoff / qset);
+	rcu_read_unlock();
+	if (dptr) {
+		data = smp_load_acquire(&dptr->data);
+		if (data)
+			q = smp_load_acquire(&data[vmf->pgoff % qset]);
+	}
+	if (!q)
+		return VM_FAULT_SIGBUS; /* a hole, or past the end */
+
+	vmf->page = virt_to_page(q);
+	get_page(vmf->page);
+	return 0;
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+	.open =     scull_vma_open,
+	.close =    scull_vma_close,
+	.fault =    scull_vma_fault,
+};
+
+int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_file *sf = filp->private_data;
+	struct scull_dev *dev = sf->dev;
+
+	/* not the rwsem, which is taken before mmap_sem elsewhere */
+	mutex_lock(&dev->map_mutex);
+	if (dev->quantum != PAGE_SIZE) {
+		mutex_unlock(&dev->map_mutex);
+		return -ENODEV; /* quanta are not pages */
+	}
+	if (dev->cow) {
+		/* stores through the mapping would go to snapshots as well */
+		mutex_unlock(&dev->map_mutex);
+		return -EBUSY;
+	}
+	vma->vm_ops = &scull_vm_ops;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = dev;
+	scull_vma_open(vma);
+	mutex_unlock(&dev->map_mutex);
+	return 0;
+}
+
 struct file_operations scull_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
-	.unlocked_ioctl =    scull_ioctl,
+	.read_iter =  scull_read_iter,
+	.write_iter = scull_write_iter,
+	.mmap =     scull_mmap,
+	.unlocked_ioctl =    scull_dev_ioctl,
 	.open =     scull_open,
 	.release =  scull_release,
 };
@@ -572,8 +1450,10 @@ void scull_cleanup_module(void)
 	/* Get rid of our char dev entries */
 	if (scull_devices) {
 		for (i = 0; i < scull_nr_devs; i++) {
-			scull_trim(scull_devices + i);
+			if (!scull_devices[i].qsets)
+				break; /* the rest were never set up */
 			cdev_del(&scull_devices[i].cdev);
+			scull_dev_cleanup(scull_devices + i);
 		}
 		kfree(scull_devices);
 	}
@@ -588,7 +1468,14 @@ void scull_cleanup_module(void)
 	/* and call the cleanup functions for friend devices */
 	scull_p_cleanup();
 	scull_access_cleanup();
+	scull_merge_cleanup();
 	scull_sort_cleanup();
+
+	/* last, as the access devices give their quanta back on cleanup */
+	if (scull_trim_wq)
+		destroy_workqueue(scull_trim_wq); /* after what was queued */
+	kmem_cache_destroy(scull_quantum_cache);
+	kmem_cache_destroy(scull_qset_cache);
 }
 
 /*
@@ -629,6 +1516,20 @@ int scull_init_module(void)
 		return result;
 	}
 
+	/*
+	 * Caches for the storage of all the scull_dev devices. Quanta are
+	 * copied to and from user space, so the whole object is whitelisted.
+	 */
+	scull_qset_cache = KMEM_CACHE(scull_qset, 0);
+	scull_quantum_size = scull_quantum;
+	scull_quantum_cache = kmem_cache_create_usercopy("scull_quantum",
+			scull_quantum_size, 0, 0, 0, scull_quantum_size, NULL);
+	scull_trim_wq = alloc_workqueue("scull_trim", WQ_UNBOUND, 0);
+	if (!scull_qset_cache || !scull_quantum_cache || !scull_trim_wq) {
+		result = -ENOMEM;
+		goto fail;
+	}
+
         /* 
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
@@ -641,9 +1542,9 @@ int scull_init_module(void)
 
         /* Initialize each device. */
 	for (i = 0; i < scull_nr_devs; i++) {
-		scull_devices[i].quantum = scull_quantum;
-		scull_devices[i].qset = scull_qset;
-		mutex_init(&scull_devices[i].mutex);
+		result = scull_dev_init(&scull_devices[i]);
+		if (result)
+			goto fail;
 		scull_setup_cdev(&scull_devices[i], i);
 	}
 
@@ -652,6 +1553,7 @@ int scull_init_module(void)
 	dev += scull_p_init(dev);
 	dev += scull_access_init(dev);
 	dev += scull_sort_init(dev);
+	dev += scull_merge_init(dev);
 
 #ifdef SCULL_DEBUG
 	scull_create_proc();
@@ -0,0 +1,356 @@
+/*
+ * merge.c -- merging reader for scullsort devices
+ *
+ * Presents several scullsort devices as one globally ordered, read-only
+ *  stream. Based upon the scullsort device; see sort.c and the neighboring
+ *  files for their copyright info.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>    /* printk(), min() */
+#include <linux/sched.h>
+#include <linux/fs.h>        /* everything... */
+#include <linux/errno.h>    /* error codes */
+#include <linux/types.h>    /* size_t */
+#include <linux/fcntl.h>
+#include <linux/poll.h>
+#include <linux/cdev.h>
+#include <linux/uio.h>      /* iov_iter */
+#include <asm/uaccess.h>
+
+
+#include "scull.h"        /* local definitions */
+
+// at most this many sort devices can be members, one per bit of the mask
+#define MERGE_MAX_MEMBERS   16
+
+// key of an exhausted member, larger than any element
+#define MERGE_DONE          INT_MAX
+
+struct scull_merge {
+        wait_queue_head_t inq;              /* readers waiting on any member */
+        struct scull_sort *members[MERGE_MAX_MEMBERS];
+        int nmembers;
+        unsigned int mask;                  /* members, as a device bitmask */
+        struct mutex mutex;                 /* guards the member list */
+        struct cdev cdev;                   /* Char device structure */
+};
+
+// A tournament (loser) tree over the members' sorted buffers. Each internal
+//  node holds the member that lost the match played there and tree[0] holds
+//  the overall winner, so replacing the winner's head costs one pass up its
+//  path, and the runner-up is always one of the losers on that same path.
+struct merge_tree {
+        const char *head[MERGE_MAX_MEMBERS];    /* next unread element */
+        unsigned int avail[MERGE_MAX_MEMBERS];  /* unread elements left */
+        int tree[MERGE_MAX_MEMBERS];
+        int k;
+};
+
+/* parameters */
+int scull_merge_members = -1;           // sort devices to merge, all of them
+dev_t scull_merge_devno;                // device number
+static bool merge_initialized = false;
+
+module_param(scull_merge_members, int, 0);
+
+static struct scull_merge merge_dev;    // device data
+
+
+
+//=============================================================================
+//                              Tournament Tree
+//=============================================================================
+
+static int merge_key(struct merge_tree *t, int member) {
+    return t->avail[member] ? *t->head[member] : MERGE_DONE;
+}
+
+// plays every match, leaf i (member i) sitting at node k + i
+static void merge_tree_build(struct merge_tree *t) {
+    int win[2 * MERGE_MAX_MEMBERS];
+    int node, a, b;
+
+    for (node = 0; node < t->k; node++)
+        win[t->k + node] = node;
+    for (node = t->k - 1; node > 0; node--) {
+        a = win[2 * node];
+        b = win[2 * node + 1];
+        if (merge_key(t, a) <= merge_key(t, b)) {
+            win[node] = a;
+            t->tree[node] = b;
+        } else {
+            win[node] = b;
+            t->tree[node] = a;
+        }
+    }
+    t->tree[0] = win[1];
+}
+
+// replays the matches on the path of a member whose head has moved on
+static void merge_tree_replay(struct merge_tree *t, int member) {
+    int node, tmp;
+
+    for (node = (member + t->k) >> 1; node; node >>= 1) {
+        if (merge_key(t, t->tree[node]) < merge_key(t, member)) {
+            tmp = t->tree[node];
+            t->tree[node] = member;
+            member = tmp;
+        }
+    }
+    t->tree[0] = member;
+}
+
+// smallest key among the members other than the winner
+static int merge_tree_second(struct merge_tree *t) {
+    int node, key = MERGE_DONE;
+
+    for (node = (t->tree[0] + t->k) >> 1; node; node >>= 1)
+        key = min(key, merge_key(t, t->tree[node]));
+    return key;
+}
+
+
+
+//=============================================================================
+//                          Open/Close & Read
+//=============================================================================
+
+// selects the members from a bitmask of sort devices
+//  does not take a lock, assumes caller is holding one
+static int merge_set_members(struct scull_merge *dev, unsigned int mask) {
+    struct scull_sort *member;
+    int i, n = 0;
+
+    for (i = 0; i < MERGE_MAX_MEMBERS; i++) {
+        if (!(mask & (1u << i)))
+            continue;
+        member = scull_sort_device(i);
+        if (!member) {
+            mask &= ~(1u << i);
+            continue;
+        }
+        dev->members[n++] = member;
+    }
+    if (!n)
+        return -EINVAL;
+    dev->nmembers = n;
+    dev->mask = mask;
+    return 0;
+}
+
+// whether any member has something to read; fine to call unlocked
+static bool merge_available(struct scull_merge *dev) {
+    int i;
+
+    for (i = 0; i < dev->nmembers; i++)
+        if (scull_sort_count(dev->members[i]))
+            return true;
+    return false;
+}
+
+static int scull_merge_open(struct inode *inode, struct file *filp) {
+    if (filp->f_mode & FMODE_WRITE)
+        return -EACCES;         // write to the members instead
+    filp->private_data = &merge_dev;
+    filp->f_mode |= FMODE_NOWAIT;       // read_iter honors it
+    return nonseekable_open(inode, filp);
+}
+
+static int scull_merge_release(struct inode *inode, struct file *filp) {
+    return 0;
+}
+
+// read the smallest elements across all members
+// Every member is locked for the duration of the read, in device order, so
+//  the merged stream is consistent. The winner of the tournament is read
+//  straight out of its buffer up to the runner-up's value, so a member whose
+//  values do not interleave with the others' is copied in a single block.
+// With IOCB_NOWAIT, neither the merge lock nor any member's is waited for.
+static ssize_t scull_merge_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_merge *dev = filp->private_data;
+    struct merge_tree t;
+    size_t count = iov_iter_count(to);
+    unsigned int run;
+    ssize_t done = 0;
+    int i, w, second;
+
+    done = scull_lock_iocb(&dev->mutex, iocb);
+    if (done)
+        return done;
+
+    while (!merge_available(dev)) {     // while there is nothing to read
+        mutex_unlock(&dev->mutex);
+
+        if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->inq, merge_available(dev)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&dev->mutex))
+            return -ERESTARTSYS;
+    }
+
+    for (i = 0; i < dev->nmembers; i++) {
+        done = scull_sort_lock(dev->members[i], iocb);
+        if (done) {
+            while (i--)
+                scull_sort_unlock(dev->members[i]);
+            mutex_unlock(&dev->mutex);
+            return done;
+        }
+    }
+
+    t.k = dev->nmembers;
+    for (i = 0; i < t.k; i++) {
+        t.head[i]  = scull_sort_peek(dev->members[i]);
+        t.avail[i] = scull_sort_count(dev->members[i]);
+    }
+    merge_tree_build(&t);
+
+    while (done < count) {
+        w = t.tree[0];
+        if (!t.avail[w])
+            break;              // every member is exhausted
+
+        second = merge_tree_second(&t);
+        run = t.avail[w];
+        if (second != MERGE_DONE)
+            run = scull_sort_count_upto(dev->members[w], (char)second);
+        run = min_t(size_t, run, count - done);
+
+        run = copy_to_iter(t.head[w], run, to);
+        if (!run) {
+            if (!done)
+                done = -EFAULT;
+            break;
+        }
+        scull_sort_consume(dev->members[w], run);
+        done += run;
+
+        t.head[w]   = scull_sort_peek(dev->members[w]);
+        t.avail[w] -= run;
+        merge_tree_replay(&t, w);
+    }
+
+    for (i = dev->nmembers - 1; i >= 0; i--)
+        scull_sort_unlock(dev->members[i]);
+    mutex_unlock(&dev->mutex);
+
+    return done;
+}
+
+static unsigned int scull_merge_poll(struct file *filp, poll_table *wait) {
+    struct scull_merge *dev = filp->private_data;
+
+    poll_wait(filp, &dev->inq, wait);
+    return merge_available(dev) ? POLLIN | POLLRDNORM : 0;
+}
+
+// called by the sort devices whenever something was written to them
+void scull_merge_wake(void) {
+    if (merge_initialized)
+        wake_up_interruptible(&merge_dev.inq);
+}
+
+
+
+//=============================================================================
+//                                  IOCTL
+//=============================================================================
+
+long scull_merge_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	struct scull_merge *dev = filp->private_data;
+	long retval = 0;
+
+	/*
+	 * extract the type and number bitfields, and don't decode
+	 * wrong cmds: return ENOTTY (inappropriate ioctl) before access_ok()
+	 */
+	if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
+	if (_IOC_NR(cmd) > SCULL_IOC_MAXNR) return -ENOTTY;
+
+	switch(cmd) {
+	  case SCULL_IOCRESET:
+		mutex_lock(&dev->mutex);
+		retval = merge_set_members(dev, scull_merge_members);
+		mutex_unlock(&dev->mutex);
+		break;
+
+	  case SCULL_MERGE_IOCTMEMBERS:
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		retval = merge_set_members(dev, arg);
+		mutex_unlock(&dev->mutex);
+		break;
+
+	  case SCULL_MERGE_IOCQMEMBERS:
+		return dev->mask;
+
+	  default:
+		return -ENOTTY;
+	}
+	return retval;
+}
+
+//=============================================================================
+//                              File Operations
+//=============================================================================
+
+struct file_operations scull_merge_fops = {
+    .owner          = THIS_MODULE,
+    .llseek         = no_llseek,
+    .read_iter      = scull_merge_read_iter,
+    .poll           = scull_merge_poll,
+    .unlocked_ioctl = scull_merge_ioctl,
+    .open           = scull_merge_open,
+    .release        = scull_merge_release,
+};
+
+
+
+// must run after scull_sort_init, as the members are taken from there
+int scull_merge_init(dev_t firstdev) {
+    int result;
+    printk("\n=== Initializing scullmerge ===\n");
+
+    result = register_chrdev_region(firstdev, 1, "scullm");
+    if (result < 0) {
+        printk(KERN_NOTICE "Unable to register scullm region: %d\n", result);
+        return 0;
+    }
+
+    init_waitqueue_head(&merge_dev.inq);
+    mutex_init(&merge_dev.mutex);
+    if (merge_set_members(&merge_dev, scull_merge_members))
+        printk(KERN_NOTICE "scullmerge: no sort devices to merge\n");
+
+    scull_merge_devno = firstdev;
+    cdev_init(&merge_dev.cdev, &scull_merge_fops);
+    merge_dev.cdev.owner = THIS_MODULE;
+    result = cdev_add(&merge_dev.cdev, scull_merge_devno, 1);
+    if (result)
+        printk(KERN_NOTICE "Error %d adding scullmerge\n", result);
+
+    merge_initialized = true;
+
+    return 1;
+}
+
+
+
+//This is called by cleanup_module or on failure.
+//  It is required to never fail, even if nothing was initialized first
+void scull_merge_cleanup(void) {
+    printk("Cleaning up scullmerge\n");
+
+    if (!merge_initialized)
+        return;
+    merge_initialized = false;
+
+    cdev_del(&merge_dev.cdev);
+    unregister_chrdev_region(scull_merge_devno, 1);
+}
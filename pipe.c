@@ -18,7 +18,7 @@
 #include <linux/moduleparam.h>
 
 #include <linux/kernel.h>	/* printk(), min() */
-#include <linux/slab.h>		/* kzalloc() */
+#include <linux/slab.h>		/* kmalloc() */
 #include <linux/sched.h>
 #include <linux/fs.h>		/* everything... */
 #include <linux/proc_fs.h>
@@ -28,19 +28,77 @@
 #include <linux/poll.h>
 #include <linux/cdev.h>
 #include <linux/seq_file.h>
+#include <linux/log2.h>		/* roundup_pow_of_two() */
+#include <linux/mm.h>		/* get_user_pages_fast() */
+#include <linux/highmem.h>	/* kmap() */
+#include <linux/spinlock.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/uio.h>		/* iov_iter */
+#include <linux/eventfd.h>
 #include <asm/uaccess.h>
 
 #include "scull.h"		/* local definitions */
 
+/*
+ * A reader about to sleep on an empty pipe leaves its buffer here, pinned,
+ * so that the next writer can copy straight into it instead of going
+ * through the ring. Only the first few pages of a large read are offered.
+ */
+#define SCULL_P_HANDOFF_PAGES 16
+
+enum { HANDOFF_IDLE, HANDOFF_WAITING, HANDOFF_CLAIMED, HANDOFF_DONE };
+
+struct scull_p_handoff {
+	struct page *pages[SCULL_P_HANDOFF_PAGES];
+	int npages;
+	unsigned int offset;               /* of the buffer in pages[0] */
+	size_t len;                        /* room in the pinned buffer */
+	size_t done;                       /* bytes the writer delivered */
+	int state;                         /* HANDOFF_*, see above */
+};
+
+/*
+ * Readers only ever move rp and writers only ever move wp, so each side has
+ * a lock of its own, on a cache line of its own, and the two sides meet only
+ * through the index the other one publishes. With one reader and one writer
+ * neither lock is ever contended; more of either just queue up on their own
+ * side. The device mutex is left for open, release and the like.
+ */
 struct scull_pipe {
         wait_queue_head_t inq, outq;       /* read and write queues */
-        char *buffer, *end;                /* begin of buf, end of buf */
-        int buffersize;                    /* used in pointer arithmetic */
-        char *rp, *wp;                     /* where to read, where to write */
+        char *buffer;                      /* the ring itself */
+        unsigned int buffersize;           /* always a power of two */
+        unsigned int wantsize;             /* set per device, or 0 */
         int nreaders, nwriters;            /* number of openings for r/w */
         struct fasync_struct *async_queue; /* asynchronous readers */
+        struct eventfd_ctx *eventfd;       /* signalled under wr_mutex */
         struct mutex mutex;              /* mutual exclusion semaphore */
         struct cdev cdev;                  /* Char device structure */
+        spinlock_t handoff_lock;           /* guards handoff */
+        struct scull_p_handoff *handoff;   /* a reader waiting for a writer */
+        int bcast;                         /* SCULL_P_BCAST_*, see scull.h */
+        bool packet;                       /* one message per write */
+        struct list_head readers;          /* open for reading, under rd_mutex */
+
+        struct mutex rd_mutex ____cacheline_aligned_in_smp; /* among readers */
+        unsigned int rp;                   /* where to read */
+
+        struct mutex wr_mutex ____cacheline_aligned_in_smp; /* among writers */
+        unsigned int wp;                   /* where to write */
+};
+
+/*
+ * One per open file. In broadcast mode every reader keeps its own position
+ * here, and the device's rp only trails the slowest of them.
+ */
+struct scull_p_file {
+	struct scull_pipe *dev;
+	struct list_head list;             /* on dev->readers */
+	unsigned int rp;                   /* where this reader reads */
+	bool lost;                         /* skipped ahead by a writer */
+	unsigned int rcvlowat, sndlowat;   /* bytes worth waking up for */
+	unsigned int rcvtimeo;             /* ms to hold out for rcvlowat */
 };
 
 /* parameters */
@@ -56,6 +114,46 @@ static struct scull_pipe *scull_p_devices;
 static int scull_p_fasync(int fd, struct file *filp, int mode);
 static int spacefree(struct scull_pipe *dev);
 
+/*
+ * The read and write positions run freely and are only masked down to an
+ * offset into the buffer when it is accessed; wp - rp is the amount of data
+ * even after they wrap around, and no slot has to be left unused.
+ */
+#define RING_OFF(dev, pos)	((pos) & ((dev)->buffersize - 1))
+
+/*
+ * In packet mode every message sits in the ring behind its length, and
+ * neither is ever split between two writes or two reads.
+ */
+#define SCULL_P_HDR	sizeof(u32)
+
+/*
+ * Lock out readers, writers and everybody else, in that order, for the
+ * operations that touch the ring as a whole.
+ */
+static int scull_p_lock_all(struct scull_pipe *dev)
+{
+	if (mutex_lock_interruptible(&dev->rd_mutex))
+		return -ERESTARTSYS;
+	if (mutex_lock_interruptible(&dev->wr_mutex)) {
+		mutex_unlock(&dev->rd_mutex);
+		return -ERESTARTSYS;
+	}
+	if (mutex_lock_interruptible(&dev->mutex)) {
+		mutex_unlock(&dev->wr_mutex);
+		mutex_unlock(&dev->rd_mutex);
+		return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+static void scull_p_unlock_all(struct scull_pipe *dev)
+{
+	mutex_unlock(&dev->mutex);
+	mutex_unlock(&dev->wr_mutex);
+	mutex_unlock(&dev->rd_mutex);
+}
+
 /*
  * Open and close
  */
@@ -63,50 +161,90 @@ static int spacefree(struct scull_pipe *dev);
 static int scull_p_open(struct inode *inode, struct file *filp)
 {
 	struct scull_pipe *dev;
+	struct scull_p_file *pf;
+	unsigned int size;
 
 	dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
-	filp->private_data = dev;
+	pf = kmalloc(sizeof(*pf), GFP_KERNEL);
+	if (!pf)
+		return -ENOMEM;
+	pf->dev = dev;
+	pf->lost = false;
+	pf->rcvlowat = pf->sndlowat = 1;
+	pf->rcvtimeo = 0;
+	filp->private_data = pf;
 
-	if (mutex_lock_interruptible(&dev->mutex))
+	if (scull_p_lock_all(dev)) {
+		kfree(pf);
 		return -ERESTARTSYS;
-	if (!dev->buffer) {
-		/* allocate the buffer */
-		dev->buffer = kzalloc(scull_p_buffer, GFP_KERNEL);
+	}
+	if (dev->nreaders + dev->nwriters == 0) {
+		/*
+		 * First one in. The buffer left over from the last user is
+		 * reused as long as it is the right size; only [rp, wp) is
+		 * ever read, so there is no need to clear it either.
+		 */
+		size = dev->wantsize;
+		if (!size)
+			size = roundup_pow_of_two(max(scull_p_buffer, 2));
+		if (dev->buffer && dev->buffersize != size) {
+			kfree(dev->buffer);
+			dev->buffer = NULL;
+		}
 		if (!dev->buffer) {
-			mutex_unlock(&dev->mutex);
-			return -ENOMEM;
+			dev->buffer = kmalloc(size, GFP_KERNEL);
+			if (!dev->buffer) {
+				scull_p_unlock_all(dev);
+				kfree(pf);
+				return -ENOMEM;
+			}
+			dev->buffersize = size;
 		}
+		dev->rp = dev->wp = 0; /* rd and wr from the beginning */
 	}
-	dev->buffersize = scull_p_buffer;
-	dev->end = dev->buffer + dev->buffersize;
-	dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
 
 	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
-	if (filp->f_mode & FMODE_READ)
+	if (filp->f_mode & FMODE_READ) {
 		dev->nreaders++;
+		pf->rp = dev->rp; /* a broadcast reader starts at the oldest data */
+		list_add_tail(&pf->list, &dev->readers);
+	}
 	if (filp->f_mode & FMODE_WRITE)
 		dev->nwriters++;
-	mutex_unlock(&dev->mutex);
+	scull_p_unlock_all(dev);
 
+	filp->f_mode |= FMODE_NOWAIT; /* read_iter and write_iter honor it */
 	return nonseekable_open(inode, filp);
 }
 
+static void scull_p_set_tail(struct scull_pipe *dev);
+
 static int scull_p_release(struct inode *inode, struct file *filp)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
 
 	/* remove this filp from the asynchronously notified filp's */
 	scull_p_fasync(-1, filp, 0);
+	mutex_lock(&dev->rd_mutex);
+	mutex_lock(&dev->wr_mutex);
 	mutex_lock(&dev->mutex);
-	if (filp->f_mode & FMODE_READ)
+	if (filp->f_mode & FMODE_READ) {
 		dev->nreaders--;
+		list_del(&pf->list);
+		if (dev->bcast)
+			scull_p_set_tail(dev); /* it may have been holding writers back */
+	}
 	if (filp->f_mode & FMODE_WRITE)
 		dev->nwriters--;
-	if (dev->nreaders + dev->nwriters == 0) {
-		kfree(dev->buffer);
-		dev->buffer = NULL; /* the other fields are not checked on open */
-	}
-	mutex_unlock(&dev->mutex);
+	/* the buffer stays for the next open; scull_p_cleanup frees it */
+	if (dev->nreaders + dev->nwriters == 0)
+		scull_set_eventfd(&dev->eventfd, -1);
+	scull_p_unlock_all(dev);
+
+	if ((filp->f_mode & FMODE_READ) && dev->bcast)
+		wake_up_interruptible(&dev->outq);
+	kfree(pf);
 	return 0;
 }
 
@@ -114,63 +252,512 @@ static int scull_p_release(struct inode *inode, struct file *filp)
  * Data management: read and write
  */
 
-static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Copy count bytes between an iov_iter and the ring, starting at position
+ * pos, and return how many made it. A transfer that crosses the end of the
+ * buffer is done in two pieces, so callers never have to stop at the wrap;
+ * the iterator takes care of the user's segments on the other side.
+ */
+static size_t scull_p_copy_out(struct scull_pipe *dev, struct iov_iter *to,
+		unsigned int pos, size_t count)
 {
-	struct scull_pipe *dev = filp->private_data;
+	unsigned int off = RING_OFF(dev, pos);
+	size_t first = min(count, (size_t)(dev->buffersize - off));
+	size_t done;
 
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
+	done = copy_to_iter(dev->buffer + off, first, to);
+	if (done == first && count > first)
+		done += copy_to_iter(dev->buffer, count - first, to);
+	return done;
+}
+
+static size_t scull_p_copy_in(struct scull_pipe *dev, struct iov_iter *from,
+		unsigned int pos, size_t count)
+{
+	unsigned int off = RING_OFF(dev, pos);
+	size_t first = min(count, (size_t)(dev->buffersize - off));
+	size_t done;
+
+	done = copy_from_iter(dev->buffer + off, first, from);
+	if (done == first && count > first)
+		done += copy_from_iter(dev->buffer, count - first, from);
+	return done;
+}
+
+/* plain memory out of and into the ring, wrapped or not */
+static void scull_p_ring_get(struct scull_pipe *dev, unsigned int pos,
+		void *p, size_t n)
+{
+	unsigned int off = RING_OFF(dev, pos);
+	size_t first = min(n, (size_t)(dev->buffersize - off));
+
+	memcpy(p, dev->buffer + off, first);
+	memcpy((char *)p + first, dev->buffer, n - first);
+}
+
+static void scull_p_ring_put(struct scull_pipe *dev, unsigned int pos,
+		const void *p, size_t n)
+{
+	unsigned int off = RING_OFF(dev, pos);
+	size_t first = min(n, (size_t)(dev->buffersize - off));
+
+	memcpy(dev->buffer + off, p, first);
+	memcpy(dev->buffer, (const char *)p + first, n - first);
+}
+
+/* whether the caller asked not to be put to sleep */
+static bool scull_p_nowait(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+		(iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+ * Each side reads the other's index with acquire semantics and publishes its
+ * own with release semantics: a reader sees the bytes before the wp that
+ * covers them, and a writer never reuses space before the reader is done.
+ */
+static unsigned int datasize(struct scull_pipe *dev)
+{
+	return smp_load_acquire(&dev->wp) - READ_ONCE(dev->rp);
+}
+
+/*
+ * Broadcast mode. Readers no longer share rp: each one reads from its own
+ * position, so every byte written reaches all of them, and rp is kept at
+ * the slowest reader's position so that writers only reuse space everyone
+ * is done with. Readers still take turns on the readers' lock, which also
+ * guards the list of them.
+ */
+
+/* what this reader can read, in either mode */
+static unsigned int scull_p_avail(struct scull_p_file *pf)
+{
+	if (!pf->dev->bcast)
+		return datasize(pf->dev);
+	return smp_load_acquire(&pf->dev->wp) - READ_ONCE(pf->rp);
+}
+
+/* where this reader reads from; caller holds the readers' lock */
+static unsigned int scull_p_rpos(struct scull_p_file *pf)
+{
+	return pf->dev->bcast ? pf->rp : pf->dev->rp;
+}
+
+/* move rp up to the slowest reader; caller holds the readers' lock */
+static void scull_p_set_tail(struct scull_pipe *dev)
+{
+	struct scull_p_file *pf;
+	unsigned int wp = smp_load_acquire(&dev->wp);
+	unsigned int tail = wp;
+
+	if (list_empty(&dev->readers))
+		return; /* keep the data for whoever opens next */
+	list_for_each_entry(pf, &dev->readers, list)
+		if (wp - pf->rp > wp - tail)
+			tail = pf->rp;
+	smp_store_release(&dev->rp, tail);
+}
+
+/* the reader is done with count bytes; caller holds the readers' lock */
+static void scull_p_consume(struct scull_p_file *pf, unsigned int count)
+{
+	struct scull_pipe *dev = pf->dev;
+
+	if (!dev->bcast) {
+		smp_store_release(&dev->rp, dev->rp + count);
+		return;
+	}
+	WRITE_ONCE(pf->rp, pf->rp + count);
+	scull_p_set_tail(dev);
+}
+
+/*
+ * SCULL_P_BCAST_DROP: instead of waiting for the readers holding up a full
+ * ring, skip them to the newest data and have their next read fail with
+ * EPIPE. With no readers at all, the buffered data is simply discarded.
+ * Caller holds the readers' lock.
+ */
+static void scull_p_drop_laggards(struct scull_pipe *dev, size_t need)
+{
+	struct scull_p_file *pf;
+	unsigned int wp = smp_load_acquire(&dev->wp);
+
+	if (spacefree(dev) >= need)
+		return; /* somebody caught up meanwhile */
+	list_for_each_entry(pf, &dev->readers, list) {
+		if (pf->rp == dev->rp) {
+			WRITE_ONCE(pf->rp, wp);
+			WRITE_ONCE(pf->lost, true);
+		}
+	}
+	if (list_empty(&dev->readers))
+		smp_store_release(&dev->rp, wp);
+	else
+		scull_p_set_tail(dev);
+}
+
+/*
+ * Direct handoff. A reader pins its buffer and offers it; the first writer
+ * to come along while the ring is still empty claims it, copies into it and
+ * marks it done. The descriptor lives on the reader's stack, so the reader
+ * never leaves while a writer holds a claim on it.
+ */
+static void scull_p_handoff_unpin(struct scull_p_handoff *ho, bool dirty)
+{
+	int i;
+
+	for (i = 0; i < ho->npages; i++) {
+		if (dirty)
+			set_page_dirty_lock(ho->pages[i]);
+		put_page(ho->pages[i]);
+	}
+}
+
+/* offer the start of the reader's buffer to writers; returns whether it was registered */
+static bool scull_p_handoff_offer(struct scull_pipe *dev,
+		struct scull_p_handoff *ho, struct iov_iter *to)
+{
+	size_t start;
+	ssize_t len;
+
+	ho->state = HANDOFF_IDLE;
+	if (READ_ONCE(dev->handoff) || !iov_iter_count(to))
+		return false; /* somebody else got there first */
+
+	/* pins the pages of the first segment, user or otherwise */
+	len = iov_iter_get_pages(to, ho->pages, SCULL_P_HANDOFF_PAGES * PAGE_SIZE,
+			SCULL_P_HANDOFF_PAGES, &start);
+	if (len <= 0)
+		return false;
+	ho->offset = start;
+	ho->len = len;
+	ho->npages = DIV_ROUND_UP(start + len, PAGE_SIZE);
+	ho->done = 0;
+
+	spin_lock(&dev->handoff_lock);
+	if (!dev->handoff) {
+		ho->state = HANDOFF_WAITING;
+		dev->handoff = ho;
+	}
+	spin_unlock(&dev->handoff_lock);
+
+	if (ho->state == HANDOFF_WAITING)
+		return true;
+	scull_p_handoff_unpin(ho, false);
+	return false;
+}
+
+/* withdraw the offer, or collect what a writer left; returns bytes received */
+static size_t scull_p_handoff_finish(struct scull_pipe *dev,
+		struct scull_p_handoff *ho)
+{
+	spin_lock(&dev->handoff_lock);
+	if (ho->state == HANDOFF_WAITING) {
+		dev->handoff = NULL;
+		ho->state = HANDOFF_IDLE;
+	}
+	spin_unlock(&dev->handoff_lock);
+
+	/* a writer that claimed it is copying right now; let it finish */
+	wait_event(dev->inq, smp_load_acquire(&ho->state) != HANDOFF_CLAIMED);
+	if (ho->state != HANDOFF_DONE)
+		ho->done = 0;
+	scull_p_handoff_unpin(ho, ho->done);
+	return ho->done;
+}
+
+/*
+ * Called by a writer holding the writers' lock. Returns the bytes delivered to
+ * a waiting reader, 0 when there is no reader to deliver to, or -EFAULT.
+ */
+static ssize_t scull_p_handoff_deliver(struct scull_pipe *dev,
+		struct iov_iter *from)
+{
+	struct scull_p_handoff *ho;
+	unsigned int off;
+	size_t count, done = 0, n, copied;
+	int i;
+
+	/* data in the ring comes first, so only hand off past an empty one */
+	spin_lock(&dev->handoff_lock);
+	ho = dev->handoff;
+	if (ho && datasize(dev) == 0) {
+		dev->handoff = NULL;
+		ho->state = HANDOFF_CLAIMED;
+	} else {
+		ho = NULL;
+	}
+	spin_unlock(&dev->handoff_lock);
+	if (!ho)
+		return 0;
+
+	count = min(iov_iter_count(from), ho->len);
+	for (i = 0, off = ho->offset; done < count; i++, off = 0) {
+		n = min_t(size_t, count - done, PAGE_SIZE - off);
+		copied = copy_page_from_iter(ho->pages[i], off, n, from);
+		done += copied;
+		if (copied < n)
+			break;
+	}
+	ho->done = done;
+	smp_store_release(&ho->state, HANDOFF_DONE);
+	wake_up(&dev->inq); /* the reader may be waiting uninterruptibly */
+
+	return done ? done : -EFAULT;
+}
+
+/*
+ * Low-watermarks. A sleeper says how many bytes of data or space it is
+ * waiting for, and its wait queue entry checks that from the waker's side,
+ * so a write or a read that leaves it short does not wake it up at all.
+ */
+struct scull_p_waiter {
+	struct wait_queue_entry wait;
+	struct scull_p_file *pf;
+	unsigned int need;
+	bool (*enough)(struct scull_p_waiter *w);
+};
+
+static bool scull_p_enough_data(struct scull_p_waiter *w)
+{
+	return scull_p_avail(w->pf) >= w->need || READ_ONCE(w->pf->lost);
+}
+
+static bool scull_p_enough_space(struct scull_p_waiter *w)
+{
+	return spacefree(w->pf->dev) >= w->need;
+}
+
+static int scull_p_wake(struct wait_queue_entry *wait, unsigned int mode,
+		int sync, void *key)
+{
+	struct scull_p_waiter *w = container_of(wait, struct scull_p_waiter, wait);
+
+	if (!w->enough(w))
+		return 0; /* not yet, let it sleep */
+	return default_wake_function(wait, mode, sync, key);
+}
+
+/*
+ * Sleep on q until there is enough, a signal arrives or timeout runs out.
+ * Returns the time left, 0 on timeout or -ERESTARTSYS.
+ */
+static long scull_p_sleep(wait_queue_head_t *q, struct scull_p_waiter *w,
+		long timeout)
+{
+	init_waitqueue_func_entry(&w->wait, scull_p_wake);
+	w->wait.private = current;
+	add_wait_queue(q, &w->wait);
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (w->enough(w))
+			break;
+		if (signal_pending(current)) {
+			timeout = -ERESTARTSYS;
+			break;
+		}
+		if (!timeout)
+			break;
+		timeout = schedule_timeout(timeout);
+	}
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(q, &w->wait);
+	return timeout;
+}
 
-	while (dev->rp == dev->wp) { /* nothing to read */
-		mutex_unlock(&dev->mutex); /* release the lock */
-		if (filp->f_flags & O_NONBLOCK)
+/* a low-watermark, cut down to what the caller asked for and what fits */
+static unsigned int scull_p_lowat(struct scull_pipe *dev, unsigned int lowat,
+		size_t count)
+{
+	if (dev->packet)
+		return 1; /* it's whole messages there */
+	return clamp_t(size_t, min_t(size_t, lowat, count), 1, dev->buffersize);
+}
+
+/* Wait for something to read; caller must hold the readers' lock.  On
+ * error the lock will be released before returning. */
+static int scull_p_wait_data(struct scull_p_file *pf, bool nonblock)
+{
+	struct scull_pipe *dev = pf->dev;
+
+	while (scull_p_avail(pf) == 0 || pf->lost) { /* nothing to read */
+		if (pf->lost) {
+			pf->lost = false;
+			mutex_unlock(&dev->rd_mutex);
+			return -EPIPE; /* see scull_p_drop_laggards */
+		}
+		mutex_unlock(&dev->rd_mutex);
+		if (nonblock)
+			return -EAGAIN;
+		if (wait_event_interruptible(dev->inq, scull_p_avail(pf) ||
+				READ_ONCE(pf->lost)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&dev->rd_mutex))
+			return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+/*
+ * Packet mode: copy out up to max whole messages, storing the length of
+ * each in lens if given. Only the first one may be cut short to fit, and
+ * what does not fit of it is lost, as with packet pipes. The caller holds
+ * the readers' lock and has seen data; returns the number of messages, with
+ * their bytes in *bytes, or -EFAULT.
+ */
+static ssize_t scull_p_read_msgs(struct scull_p_file *pf, struct iov_iter *to,
+		unsigned int __user *lens, unsigned int max, size_t *bytes)
+{
+	struct scull_pipe *dev = pf->dev;
+	unsigned int pos = scull_p_rpos(pf);
+	unsigned int avail = scull_p_avail(pf);
+	unsigned int n;
+	size_t want;
+	u32 len;
+
+	*bytes = 0;
+	for (n = 0; n < max && avail; n++) {
+		scull_p_ring_get(dev, pos, &len, SCULL_P_HDR);
+		want = min_t(size_t, len, iov_iter_count(to));
+		if (n && want < len)
+			break; /* leave it for the next call */
+		if (scull_p_copy_out(dev, to, pos + SCULL_P_HDR, want) != want ||
+				(lens && put_user(want, lens + n)))
+			break;
+		pos += SCULL_P_HDR + len;
+		avail -= SCULL_P_HDR + len;
+		*bytes += want;
+	}
+	if (!n)
+		return -EFAULT;
+	scull_p_consume(pf, pos - scull_p_rpos(pf));
+	return n;
+}
+
+/*
+ * Reads and writes work on a whole iov_iter, so readv() and writev() move
+ * every segment under one acquisition of the lock. IOCB_NOWAIT is treated
+ * like O_NONBLOCK, including for the lock itself.
+ */
+static ssize_t scull_p_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	struct scull_p_handoff ho;
+	struct scull_p_waiter w = { .pf = pf, .enough = scull_p_enough_data };
+	size_t count, got;
+	ssize_t err;
+	long timeout;
+
+	if (dev->packet && !iov_iter_count(to))
+		return 0; /* don't throw a message away */
+	w.need = scull_p_lowat(dev, pf->rcvlowat, iov_iter_count(to));
+	err = scull_lock_iocb(&dev->rd_mutex, iocb);
+	if (err)
+		return err;
+
+	while (scull_p_avail(pf) < w.need || pf->lost) { /* not enough to read */
+		if (pf->lost) {
+			pf->lost = false;
+			mutex_unlock(&dev->rd_mutex);
+			return -EPIPE; /* see scull_p_drop_laggards */
+		}
+		if (scull_p_avail(pf) && scull_p_nowait(iocb))
+			break; /* no waiting for the rest, take what there is */
+		mutex_unlock(&dev->rd_mutex); /* release the lock */
+		if (scull_p_nowait(iocb))
 			return -EAGAIN;
 		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
+		if (w.need > 1) {
+			/* a writer won't fill up a handed-off buffer, so no handoff */
+			timeout = pf->rcvtimeo ? msecs_to_jiffies(pf->rcvtimeo) :
+					MAX_SCHEDULE_TIMEOUT;
+			timeout = scull_p_sleep(&dev->inq, &w, timeout);
+			if (timeout < 0)
+				return timeout;
+			if (!timeout)
+				w.need = 1; /* waited long enough, settle for anything */
+			if (mutex_lock_interruptible(&dev->rd_mutex))
+				return -ERESTARTSYS;
+			continue;
+		}
+		if (dev->bcast || dev->packet)
+			ho.state = HANDOFF_IDLE; /* not a plain stream */
+		else
+			scull_p_handoff_offer(dev, &ho, to);
+		err = wait_event_interruptible(dev->inq, scull_p_avail(pf) ||
+				READ_ONCE(pf->lost) ||
+				smp_load_acquire(&ho.state) == HANDOFF_DONE);
+		if (ho.state != HANDOFF_IDLE) {
+			got = scull_p_handoff_finish(dev, &ho);
+			if (got) {
+				iov_iter_advance(to, got);
+				return got; /* a writer filled the buffer for us */
+			}
+		}
+		if (err)
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
 		/* otherwise loop, but first reacquire the lock */
-		if (mutex_lock_interruptible(&dev->mutex))
+		if (mutex_lock_interruptible(&dev->rd_mutex))
 			return -ERESTARTSYS;
 	}
-	/* ok, data is there, return something */
-	if (dev->wp > dev->rp)
-		count = min(count, (size_t)(dev->wp - dev->rp));
-	else /* the write pointer has wrapped, return data up to dev->end */
-		count = min(count, (size_t)(dev->end - dev->rp));
-	if (copy_to_user(buf, dev->rp, count)) {
-		mutex_unlock (&dev->mutex);
+	if (dev->packet) {
+		err = scull_p_read_msgs(pf, to, NULL, 1, &count);
+		mutex_unlock(&dev->rd_mutex);
+		if (err < 0)
+			return err;
+		goto wake;
+	}
+
+	/* ok, data is there, return something, wrapped or not */
+	count = min(iov_iter_count(to), (size_t)scull_p_avail(pf));
+	got = scull_p_copy_out(dev, to, scull_p_rpos(pf), count);
+	if (!got && count) {
+		mutex_unlock (&dev->rd_mutex);
 		return -EFAULT;
 	}
-	dev->rp += count;
-	if (dev->rp == dev->end)
-		dev->rp = dev->buffer; /* wrapped */
-	mutex_unlock (&dev->mutex);
+	count = got;
+	scull_p_consume(pf, count);
+	mutex_unlock (&dev->rd_mutex);
 
-	/* finally, awake any writers and return */
-	wake_up_interruptible(&dev->outq);
+  wake:
+	/* finally, awake any writers and return; nobody waiting is the usual case */
+	if (wq_has_sleeper(&dev->outq))
+		wake_up_interruptible(&dev->outq);
 	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
 	return count;
 }
 
-/* Wait for space for writing; caller must hold device semaphore.  On
- * error the semaphore will be released before returning. */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+/* Wait for need bytes of space for writing; caller must hold the writers'
+ * lock.  On error the lock will be released before returning. */
+static int scull_getwritespace(struct scull_p_file *pf, size_t need, bool nonblock)
 {
-	while (spacefree(dev) == 0) { /* full */
-		DEFINE_WAIT(wait);
-		
-		mutex_unlock(&dev->mutex);
-		if (filp->f_flags & O_NONBLOCK)
+	struct scull_pipe *dev = pf->dev;
+	struct scull_p_waiter w = {
+		.pf = pf, .need = need, .enough = scull_p_enough_space
+	};
+
+	while (spacefree(dev) < need) { /* full */
+		mutex_unlock(&dev->wr_mutex);
+		if (dev->bcast == SCULL_P_BCAST_DROP) {
+			/* readers before writers, as everywhere else */
+			if (mutex_lock_interruptible(&dev->rd_mutex))
+				return -ERESTARTSYS;
+			scull_p_drop_laggards(dev, need);
+			mutex_unlock(&dev->rd_mutex);
+			if (mutex_lock_interruptible(&dev->wr_mutex))
+				return -ERESTARTSYS;
+			continue;
+		}
+		if (nonblock)
 			return -EAGAIN;
 		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
-		prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-		if (spacefree(dev) == 0)
-			schedule();
-		finish_wait(&dev->outq, &wait);
-		if (signal_pending(current))
+		/* woken only once there is room for need bytes */
+		if (scull_p_sleep(&dev->outq, &w, MAX_SCHEDULE_TIMEOUT) < 0)
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
-		if (mutex_lock_interruptible(&dev->mutex))
+		if (mutex_lock_interruptible(&dev->wr_mutex))
 			return -ERESTARTSYS;
 	}
 	return 0;
@@ -179,43 +766,101 @@ static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
 /* How much space is free? */
 static int spacefree(struct scull_pipe *dev)
 {
-	if (dev->rp == dev->wp)
-		return dev->buffersize - 1;
-	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+	return dev->buffersize - (READ_ONCE(dev->wp) - smp_load_acquire(&dev->rp));
 }
 
-static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Packet mode: the whole write goes into the ring as one message, behind
+ * its length, or none of it does. Called with the writers' lock held, which
+ * is always released; returns the size of the message or an error.
+ */
+static ssize_t scull_p_write_msg(struct scull_p_file *pf, struct kiocb *iocb,
+		struct iov_iter *from)
 {
-	struct scull_pipe *dev = filp->private_data;
-	int result;
+	struct scull_pipe *dev = pf->dev;
+	size_t count = iov_iter_count(from);
+	u32 len = count;
+	ssize_t result;
 
-	if (mutex_lock_interruptible(&dev->mutex))
-		return -ERESTARTSYS;
+	if (!count) {
+		mutex_unlock(&dev->wr_mutex);
+		return 0; /* no empty messages */
+	}
+	if (count + SCULL_P_HDR > dev->buffersize) {
+		mutex_unlock(&dev->wr_mutex);
+		return -EMSGSIZE;
+	}
+	result = scull_getwritespace(pf, count + SCULL_P_HDR, scull_p_nowait(iocb));
+	if (result)
+		return result; /* scull_getwritespace called mutex_unlock(&dev->wr_mutex) */
+
+	if (scull_p_copy_in(dev, from, dev->wp + SCULL_P_HDR, count) != count) {
+		mutex_unlock(&dev->wr_mutex);
+		return -EFAULT; /* nothing was published */
+	}
+	scull_p_ring_put(dev, dev->wp, &len, SCULL_P_HDR);
+	smp_store_release(&dev->wp, dev->wp + SCULL_P_HDR + count);
+	if (dev->eventfd)
+		eventfd_signal(dev->eventfd, 1);
+	mutex_unlock(&dev->wr_mutex);
+	return count;
+}
+
+static ssize_t scull_p_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scull_p_file *pf = iocb->ki_filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	size_t count;
+	ssize_t result;
 
-	/* Make sure there's space to write */
-	result = scull_getwritespace(dev, filp);
+	result = scull_lock_iocb(&dev->wr_mutex, iocb);
 	if (result)
-		return result; /* scull_getwritespace called mutex_unlock(&dev->mutex) */
-
-	/* ok, space is there, accept something */
-	count = min(count, (size_t)spacefree(dev));
-	if (dev->wp >= dev->rp)
-		count = min(count, (size_t)(dev->end - dev->wp)); /* to end-of-buf */
-	else /* the write pointer has wrapped, fill up to rp-1 */
-		count = min(count, (size_t)(dev->rp - dev->wp - 1));
-	PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-	if (copy_from_user(dev->wp, buf, count)) {
-		mutex_unlock (&dev->mutex);
+		return result;
+
+	/* a reader is already waiting: skip the ring and copy to it directly */
+	if (iov_iter_count(from) && READ_ONCE(dev->handoff)) {
+		result = scull_p_handoff_deliver(dev, from);
+		if (result) {
+			mutex_unlock(&dev->wr_mutex);
+			return result;
+		}
+	}
+
+	if (dev->packet) {
+		result = scull_p_write_msg(pf, iocb, from);
+		if (result <= 0)
+			return result; /* scull_p_write_msg unlocked, see there */
+		count = result;
+		goto wake;
+	}
+
+	/* Make sure there's space to write, as much as the writer asked for */
+	if (scull_p_nowait(iocb))
+		result = scull_getwritespace(pf, 1, true);
+	else
+		result = scull_getwritespace(pf, scull_p_lowat(dev, pf->sndlowat,
+				iov_iter_count(from)), false);
+	if (result)
+		return result; /* scull_getwritespace called mutex_unlock(&dev->wr_mutex) */
+
+	/* ok, space is there, accept something, across the wrap if need be */
+	count = min(iov_iter_count(from), (size_t)spacefree(dev));
+	PDEBUG("Going to accept %li bytes to %u\n", (long)count, dev->wp);
+	result = scull_p_copy_in(dev, from, dev->wp, count);
+	if (!result && count) {
+		mutex_unlock (&dev->wr_mutex);
 		return -EFAULT;
 	}
-	dev->wp += count;
-	if (dev->wp == dev->end)
-		dev->wp = dev->buffer; /* wrapped */
-	mutex_unlock(&dev->mutex);
+	count = result;
+	smp_store_release(&dev->wp, dev->wp + count);
+	if (dev->eventfd)
+		eventfd_signal(dev->eventfd, count);
+	mutex_unlock(&dev->wr_mutex);
 
+  wake:
 	/* finally, awake any reader */
-	wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
+	if (wq_has_sleeper(&dev->inq))
+		wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
 
 	/* and signal asynchronous readers, explained late in chapter 5 */
 	if (dev->async_queue)
@@ -224,34 +869,369 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
 	return count;
 }
 
+/*
+ * Splice support. Data spliced out of the device is copied once, from the
+ * ring into fresh pages which the pipe then owns and may hand on without
+ * copying again; data spliced in is copied once, from the pipe's pages
+ * straight into the ring. Neither direction goes through user space.
+ */
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+	.can_merge = 0,
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+static void scull_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/*
+ * Copy the data described by vec into new pages and splice them into pipe;
+ * at most PIPE_DEF_BUFFERS pages are filled. Returns the bytes the pipe took.
+ * Also used by scullsort.
+ */
+ssize_t scull_splice_out(struct pipe_inode_info *pipe, const struct kvec *vec,
+		int nvec)
+{
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &scull_pipe_buf_ops,
+		.spd_release = scull_spd_release,
+	};
+	size_t off = 0, len, n;
+	char *addr;
+
+	while (nvec && spd.nr_pages < PIPE_DEF_BUFFERS) {
+		if (!vec->iov_len) { /* e.g. the second half of an unwrapped ring */
+			vec++;
+			nvec--;
+			continue;
+		}
+		pages[spd.nr_pages] = alloc_page(GFP_KERNEL);
+		if (!pages[spd.nr_pages])
+			break;
+		addr = page_address(pages[spd.nr_pages]);
+		for (len = 0; len < PAGE_SIZE && nvec; len += n) {
+			n = min_t(size_t, PAGE_SIZE - len, vec->iov_len - off);
+			memcpy(addr + len, (char *)vec->iov_base + off, n);
+			off += n;
+			if (off == vec->iov_len) {
+				vec++;
+				nvec--;
+				off = 0;
+			}
+		}
+		partial[spd.nr_pages].offset = 0;
+		partial[spd.nr_pages].len = len;
+		spd.nr_pages++;
+	}
+	if (!spd.nr_pages)
+		return nvec ? -ENOMEM : 0;
+	return splice_to_pipe(pipe, &spd);
+}
+
+static ssize_t scull_p_splice_read(struct file *filp, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	struct kvec vec[2];
+	unsigned int off;
+	ssize_t ret;
+
+	if (dev->packet)
+		return -EINVAL; /* the pipe would split the messages up */
+	if (mutex_lock_interruptible(&dev->rd_mutex))
+		return -ERESTARTSYS;
+	ret = scull_p_wait_data(pf, (filp->f_flags & O_NONBLOCK) ||
+			(flags & SPLICE_F_NONBLOCK));
+	if (ret)
+		return ret; /* scull_p_wait_data called mutex_unlock(&dev->rd_mutex) */
+
+	/* the data as it sits in the ring, wrapped or not */
+	len = min_t(size_t, len, scull_p_avail(pf));
+	len = min_t(size_t, len, PIPE_DEF_BUFFERS * PAGE_SIZE);
+	off = RING_OFF(dev, scull_p_rpos(pf));
+	vec[0].iov_base = dev->buffer + off;
+	vec[0].iov_len = min_t(size_t, len, dev->buffersize - off);
+	vec[1].iov_base = dev->buffer;
+	vec[1].iov_len = len - vec[0].iov_len;
+
+	/* only what the pipe actually took is consumed */
+	ret = scull_splice_out(pipe, vec, 2);
+	if (ret > 0)
+		scull_p_consume(pf, ret);
+	mutex_unlock(&dev->rd_mutex);
+
+	if (ret > 0 && wq_has_sleeper(&dev->outq))
+		wake_up_interruptible(&dev->outq);
+	return ret;
+}
+
+/* moves one pipe buffer, or as much of it as fits, into the ring */
+static int scull_p_splice_actor(struct pipe_inode_info *pipe,
+		struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct file *filp = sd->u.file;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	unsigned int off;
+	size_t count, first;
+	char *addr;
+	int result;
+
+	if (mutex_lock_interruptible(&dev->wr_mutex))
+		return -ERESTARTSYS;
+	result = scull_getwritespace(pf, 1, (filp->f_flags & O_NONBLOCK) ||
+			(sd->flags & SPLICE_F_NONBLOCK));
+	if (result)
+		return result; /* scull_getwritespace called mutex_unlock(&dev->wr_mutex) */
+
+	count = min_t(size_t, sd->len, spacefree(dev));
+	off = RING_OFF(dev, dev->wp);
+	first = min_t(size_t, count, dev->buffersize - off);
+	addr = kmap_atomic(buf->page);
+	memcpy(dev->buffer + off, addr + buf->offset, first);
+	memcpy(dev->buffer, addr + buf->offset + first, count - first);
+	kunmap_atomic(addr);
+	smp_store_release(&dev->wp, dev->wp + count);
+	if (dev->eventfd)
+		eventfd_signal(dev->eventfd, count);
+	mutex_unlock(&dev->wr_mutex);
+
+	if (wq_has_sleeper(&dev->inq))
+		wake_up_interruptible(&dev->inq);
+	if (dev->async_queue)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	return count;
+}
+
+/*
+ * Pages gifted with vmsplice are copied like any other: the ring is one
+ * contiguous buffer, so there is nowhere to put a stolen page.
+ */
+static ssize_t scull_p_splice_write(struct pipe_inode_info *pipe,
+		struct file *filp, loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct scull_p_file *pf = filp->private_data;
+
+	if (pf->dev->packet)
+		return -EINVAL; /* pipe buffers are not messages */
+	return splice_from_pipe(pipe, filp, ppos, len, flags, scull_p_splice_actor);
+}
+
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
 	unsigned int mask = 0;
 
 	/*
 	 * The buffer is circular; it is considered full
-	 * if "wp" is right behind "rp" and empty if the
-	 * two are equal.
+	 * if "wp" is a whole buffer ahead of "rp" and empty
+	 * if the two are equal. Neither side's lock is needed
+	 * to look at the indices.
 	 */
-	mutex_lock(&dev->mutex);
 	poll_wait(filp, &dev->inq,  wait);
 	poll_wait(filp, &dev->outq, wait);
-	if (dev->rp != dev->wp)
+	if (scull_p_avail(pf) >= scull_p_lowat(dev, pf->rcvlowat, UINT_MAX) ||
+			READ_ONCE(pf->lost))
 		mask |= POLLIN | POLLRDNORM;	/* readable */
-	if (spacefree(dev))
+	if (spacefree(dev) >= scull_p_lowat(dev, pf->sndlowat, UINT_MAX) +
+			(dev->packet ? SCULL_P_HDR : 0) ||
+			dev->bcast == SCULL_P_BCAST_DROP)
 		mask |= POLLOUT | POLLWRNORM;	/* writable */
-	mutex_unlock(&dev->mutex);
 	return mask;
 }
 
 static int scull_p_fasync(int fd, struct file *filp, int mode)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
 
 	return fasync_helper(fd, filp, mode, &dev->async_queue);
 }
 
+/*
+ * Give one device a ring of a new size, keeping whatever is buffered in it.
+ * Readers and writers are locked out while the data moves to the start of
+ * the new ring; the size then sticks to the device across opens.
+ */
+static long scull_p_resize(struct scull_pipe *dev, unsigned long size)
+{
+	struct scull_p_file *pf;
+	unsigned int count;
+	char *buffer;
+	long retval = 0;
+
+	if (size < 2 || size > KMALLOC_MAX_SIZE)
+		return -EINVAL;
+	size = roundup_pow_of_two(size);
+	buffer = kmalloc(size, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+	if (scull_p_lock_all(dev)) {
+		kfree(buffer);
+		return -ERESTARTSYS;
+	}
+
+	count = dev->wp - dev->rp;
+	if (count > size) {
+		retval = -EBUSY; /* read some of it first */
+		goto out;
+	}
+	scull_p_ring_get(dev, dev->rp, buffer, count);
+	swap(buffer, dev->buffer);
+	dev->buffersize = dev->wantsize = size;
+	list_for_each_entry(pf, &dev->readers, list)
+		pf->rp -= dev->rp; /* broadcast positions move along */
+	dev->rp = 0;
+	dev->wp = count;
+
+  out:
+	scull_p_unlock_all(dev);
+	kfree(buffer); /* the old ring, or the new one if unused */
+	if (!retval)
+		wake_up_interruptible(&dev->outq);
+	return retval;
+}
+
+/*
+ * Readers can't change the way they read halfway through, so the modes are
+ * only switched while nobody has the device open for reading. Packet mode
+ * lays the data out differently, so it also needs an empty ring.
+ */
+static long scull_p_set_mode(struct scull_pipe *dev, unsigned int cmd,
+		unsigned long arg)
+{
+	long retval = 0;
+
+	if (cmd == SCULL_P_IOCTBCAST && arg > SCULL_P_BCAST_DROP)
+		return -EINVAL;
+	if (scull_p_lock_all(dev))
+		return -ERESTARTSYS;
+	if (dev->nreaders)
+		retval = -EBUSY;
+	else if (cmd == SCULL_P_IOCTBCAST)
+		dev->bcast = arg;
+	else if (dev->wp != dev->rp)
+		retval = -EBUSY;
+	else
+		dev->packet = arg;
+	scull_p_unlock_all(dev);
+	if (!retval)
+		wake_up_interruptible(&dev->outq); /* dropping lets writers on */
+	return retval;
+}
+
+/*
+ * Packet mode: as many whole messages as fit in one call, back to back,
+ * with a table of their lengths. Waits for the first like read does.
+ */
+static long scull_p_read_batch(struct file *filp,
+		struct scull_p_batch __user *ubatch)
+{
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	struct scull_p_batch batch;
+	struct iovec iov;
+	struct iov_iter to;
+	size_t bytes;
+	long retval;
+
+	if (!(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	if (!dev->packet)
+		return -EINVAL;
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (!batch.size || !batch.nlens)
+		return -EINVAL;
+	retval = import_single_range(READ, (void __user *)batch.data, batch.size,
+			&iov, &to);
+	if (retval)
+		return retval;
+
+	if (mutex_lock_interruptible(&dev->rd_mutex))
+		return -ERESTARTSYS;
+	retval = scull_p_wait_data(pf, filp->f_flags & O_NONBLOCK);
+	if (retval)
+		return retval; /* scull_p_wait_data called mutex_unlock(&dev->rd_mutex) */
+	retval = scull_p_read_msgs(pf, &to, (unsigned int __user *)batch.lens,
+			batch.nlens, &bytes);
+	mutex_unlock(&dev->rd_mutex);
+
+	if (retval > 0 && wq_has_sleeper(&dev->outq))
+		wake_up_interruptible(&dev->outq);
+	return retval;
+}
+
+/*
+ * The per-device ioctls; everything else is shared with bare scull.
+ */
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	struct scull_p_lowat lowat;
+	long retval;
+
+	switch(cmd) {
+
+	  case SCULL_P_IOCTBUFSIZE:
+		return scull_p_resize(dev, arg);
+
+	  case SCULL_P_IOCQBUFSIZE:
+		return dev->buffersize;
+
+	  case SCULL_P_IOCTBCAST:
+	  case SCULL_P_IOCTPACKET:
+		return scull_p_set_mode(dev, cmd, arg);
+
+	  case SCULL_P_IOCQBCAST:
+		return dev->bcast;
+
+	  case SCULL_P_IOCQPACKET:
+		return dev->packet;
+
+	  case SCULL_P_IOCXBATCH:
+		return scull_p_read_batch(filp, (struct scull_p_batch __user *)arg);
+
+	  case SCULL_P_IOCSLOWAT: /* for this open file only */
+		if (copy_from_user(&lowat, (void __user *)arg, sizeof(lowat)))
+			return -EFAULT;
+		pf->rcvlowat = max(lowat.rcvlowat, 1U);
+		pf->sndlowat = max(lowat.sndlowat, 1U);
+		pf->rcvtimeo = lowat.rcvtimeo;
+		return 0;
+
+	  case SCULL_IOCTEVENTFD: /* writers signal it, so under their lock */
+		if (mutex_lock_interruptible(&dev->wr_mutex))
+			return -ERESTARTSYS;
+		retval = scull_set_eventfd(&dev->eventfd, (int)arg);
+		mutex_unlock(&dev->wr_mutex);
+		return retval;
+
+	  case SCULL_P_IOCGLOWAT:
+		lowat.rcvlowat = pf->rcvlowat;
+		lowat.sndlowat = pf->sndlowat;
+		lowat.rcvtimeo = pf->rcvtimeo;
+		if (copy_to_user((void __user *)arg, &lowat, sizeof(lowat)))
+			return -EFAULT;
+		return 0;
+
+	  default:
+		return scull_ioctl(filp, cmd, arg);
+	}
+}
+
 #ifdef SCULL_DEBUG
 static int scull_read_p_mem_proc_show(struct seq_file *m, void *v)
 {
@@ -266,9 +1246,13 @@ static int scull_read_p_mem_proc_show(struct seq_file *m, void *v)
 			return -ERESTARTSYS;
 		seq_printf(m, "\nDevice %i: %p\n", i, p);
 /*		seq_printf(m, "   Queues: %p %p\n", p->inq, p->outq);*/
-		seq_printf(m, "   Buffer: %p to %p (%i bytes)\n", p->buffer, p->end, p->buffersize);
-		seq_printf(m, "   rp %p   wp %p\n", p->rp, p->wp);
+		seq_printf(m, "   Buffer: %p (%u bytes)\n", p->buffer, p->buffersize);
+		seq_printf(m, "   rp %u   wp %u\n", p->rp, p->wp);
 		seq_printf(m, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
+		if (p->bcast)
+			seq_printf(m, "   broadcast mode %i\n", p->bcast);
+		if (p->packet)
+			seq_printf(m, "   packet mode\n");
 		mutex_unlock(&p->mutex);
 	}
 	return 0;
@@ -299,13 +1283,15 @@ DEFINE_PROC_SEQ_FILE(scull_read_p_mem)
 struct file_operations scull_pipe_fops = {
 	.owner =	THIS_MODULE,
 	.llseek =	no_llseek,
-	.read =		scull_p_read,
-	.write =	scull_p_write,
+	.read_iter =	scull_p_read_iter,
+	.write_iter =	scull_p_write_iter,
 	.poll =		scull_p_poll,
-	.unlocked_ioctl =	scull_ioctl,
+	.unlocked_ioctl =	scull_p_ioctl,
 	.open =		scull_p_open,
 	.release =	scull_p_release,
 	.fasync =	scull_p_fasync,
+	.splice_read =	scull_p_splice_read,
+	.splice_write =	scull_p_splice_write,
 };
 
 /*
@@ -345,6 +1331,10 @@ int scull_p_init(dev_t firstdev)
 		init_waitqueue_head(&(scull_p_devices[i].inq));
 		init_waitqueue_head(&(scull_p_devices[i].outq));
 		mutex_init(&scull_p_devices[i].mutex);
+		mutex_init(&scull_p_devices[i].rd_mutex);
+		mutex_init(&scull_p_devices[i].wr_mutex);
+		spin_lock_init(&scull_p_devices[i].handoff_lock);
+		INIT_LIST_HEAD(&scull_p_devices[i].readers);
 		scull_p_setup_cdev(scull_p_devices + i, i);
 	}
 #ifdef SCULL_DEBUG
@@ -371,6 +1361,7 @@ void scull_p_cleanup(void)
 	for (i = 0; i < scull_p_nr_devs; i++) {
 		cdev_del(&scull_p_devices[i].cdev);
 		kfree(scull_p_devices[i].buffer);
+		scull_set_eventfd(&scull_p_devices[i].eventfd, -1);
 	}
 	kfree(scull_p_devices);
 	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
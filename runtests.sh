@@ -8,6 +8,13 @@ echo "demonstrates persistance of data"
 ./writestuff
 ./readstuff
 
+echo
+echo "sortstats"
+echo "demonstrates non-destructive order statistics"
+./writestuff
+./sortstats
+./readstuff
+
 echo
 echo "readmore"
 echo "demonstrates read blocking on empty buffer - please write to the SORT"
@@ -53,12 +53,12 @@
 #endif
 
 #ifndef SCULL_SORT_NR_DEVS
-#define SCULL_SORT_NR_DEVS 1  /* scullsort0 */
+#define SCULL_SORT_NR_DEVS 4  /* scullsort0 through scullsort3 */
 #endif
 
 /*
  * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * Use a radix tree of indirect blocks, indexed by their number.
  *
  * "scull_dev->data" points to an array of pointers, each
  * pointer refers to a memory area of SCULL_QUANTUM bytes.
@@ -74,7 +74,51 @@
 #endif
 
 /*
- * The pipe device is a simple circular buffer. Here its default size
+ * Quanta freed by a trim are kept for reuse by the same device, up to
+ * this many of them, and as long as they take less than SCULL_POOL_BYTES
+ */
+#ifndef SCULL_POOL
+#define SCULL_POOL    64
+#endif
+
+#ifndef SCULL_POOL_BYTES
+#define SCULL_POOL_BYTES (1 << 20)
+#endif
+
+/*
+ * In auto mode a device picks its own quantum at each trim, from what was
+ * written since the one before: a quantum the size of an average write,
+ * or one that holds the device in about SCULL_AUTO_QUANTA quanta, if
+ * that's bigger. It is SCULL_QUANTUM, or a power of two up to
+ * SCULL_AUTO_MAX, two 2MB huge pages.
+ */
+#ifndef SCULL_AUTO_QUANTA
+#define SCULL_AUTO_QUANTA 1024
+#endif
+
+#ifndef SCULL_AUTO_MAX
+#define SCULL_AUTO_MAX (4 << 20)
+#endif
+
+/*
+ * The largest qset a single device may ask for; its pointer array comes
+ * from kmalloc. SCULL_AUTO_MAX also bounds the quantum it may ask for.
+ */
+#ifndef SCULL_QSET_MAX
+#define SCULL_QSET_MAX 65536
+#endif
+
+/*
+ * The most a single SCULL_IOCSPREALLOC fills in. Unlike a write, what it
+ * allocates is not bounded by anything the caller hands in.
+ */
+#ifndef SCULL_PREALLOC_MAX
+#define SCULL_PREALLOC_MAX (64 << 20)
+#endif
+
+/*
+ * The pipe device is a simple circular buffer. Here its default size,
+ * which is rounded up to a power of two when the buffer is allocated
  */
 #ifndef SCULL_P_BUFFER
 #define SCULL_P_BUFFER 4000
@@ -84,24 +128,81 @@
 #define SCULL_SORT_BUFFER 64
 #endif
 
+#ifdef __KERNEL__
+
+#include <linux/radix-tree.h>
+#include <linux/rwsem.h>
+
 /*
- * Representation of scull quantum sets.
+ * Representation of scull quantum sets. Set n holds bytes from
+ * n * quantum * qset on, and is found in the tree without going
+ * through the ones before it; holes are simply not in the tree.
  */
 struct scull_qset {
 	void **data;
-	struct scull_qset *next;
+	unsigned long index;      /* n, its key in the tree */
 };
 
 struct scull_dev {
-	struct scull_qset *data;  /* Pointer to first quantum set */
+	struct radix_tree_root *qsets; /* quantum sets, by index; see scull_trim */
 	int quantum;              /* the current quantum size */
 	int qset;                 /* the current array size */
+	int want_quantum;         /* used from the next trim, 0 for the default */
+	int want_qset;            /* likewise */
+	unsigned long wbytes;     /* written since the last trim, for auto mode */
+	unsigned long nwrites;    /* in this many calls */
 	unsigned long size;       /* amount of data stored here */
+	unsigned long gen;        /* bumped whenever qsets are freed */
+	void *pool;               /* spare quanta, chained through their first word */
+	int npool;                /* how many of them */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
-	struct mutex mutex;     /* mutual exclusion semaphore     */
+	struct rw_semaphore rwsem; /* shared by readers, exclusive otherwise */
+	struct mutex map_mutex;   /* orders mmap against trim */
+	atomic_t vmas;            /* active mappings */
+	bool cow;                 /* may share quanta with a snapshot */
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
+/*
+ * Per-open state of the bare devices and of those in access.c: the
+ * qset the last read or write ended in, so sequential I/O doesn't go
+ * back to the tree. It is only trusted while dev->gen is still gen.
+ */
+struct scull_file {
+	struct scull_dev *dev;
+	struct scull_qset *qs;    /* last qset resolved, or NULL */
+	unsigned long gen;        /* dev->gen when qs was resolved */
+};
+
+/*
+ * Take a device lock for read_iter/write_iter. With IOCB_NOWAIT (io_uring
+ * trying the I/O inline before punting it to a worker) the lock is only
+ * tried, and -EAGAIN returned if it is busy.
+ */
+static inline int scull_lock_iocb(struct mutex *mutex, struct kiocb *iocb)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return mutex_trylock(mutex) ? 0 : -EAGAIN;
+	return mutex_lock_interruptible(mutex) ? -ERESTARTSYS : 0;
+}
+
+/*
+ * The same for the rwsem of the bare devices, which reads only take
+ * shared so they run side by side; writes and trims take it exclusive.
+ */
+static inline int scull_down_iocb(struct rw_semaphore *sem,
+		struct kiocb *iocb, bool write)
+{
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (write)
+			return down_write_trylock(sem) ? 0 : -EAGAIN;
+		return down_read_trylock(sem) ? 0 : -EAGAIN;
+	}
+	if (write)
+		return down_write_killable(sem) ? -ERESTARTSYS : 0;
+	return down_read_killable(sem) ? -ERESTARTSYS : 0;
+}
+
 /*
  * Split minors in two parts
  */
@@ -120,6 +221,7 @@ extern int scull_qset;
 extern int scull_p_buffer;	/* pipe.c */
 
 extern int scull_sort_buffer;	/* sort.c */
+extern int scull_sort_nr_devs;
 
 /*
  * Prototypes for shared functions
@@ -127,22 +229,51 @@ extern int scull_sort_buffer;	/* sort.c */
 
 int     scull_p_init(dev_t dev);
 void    scull_p_cleanup(void);
+struct pipe_inode_info;
+struct kvec;
+ssize_t scull_splice_out(struct pipe_inode_info *pipe, const struct kvec *vec,
+		int nvec);
 
 int     scull_sort_init(dev_t dev);
 void    scull_sort_cleanup(void);
 
+int     scull_merge_init(dev_t dev);
+void    scull_merge_cleanup(void);
+void    scull_merge_wake(void);
+
+/*
+ * What scullmerge needs from the scullsort devices it reads from
+ */
+struct scull_sort;
+
+struct scull_sort *scull_sort_device(int index);
+int     scull_sort_lock(struct scull_sort *dev, struct kiocb *iocb);
+void    scull_sort_unlock(struct scull_sort *dev);
+unsigned int scull_sort_count(struct scull_sort *dev);
+const char *scull_sort_peek(struct scull_sort *dev);
+unsigned int scull_sort_count_upto(struct scull_sort *dev, char value);
+void    scull_sort_consume(struct scull_sort *dev, unsigned int count);
+
 int     scull_access_init(dev_t dev);
 void    scull_access_cleanup(void);
 
 int     scull_trim(struct scull_dev *dev);
-
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                   loff_t *f_pos);
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos);
+int     scull_dev_init(struct scull_dev *dev);
+void    scull_dev_cleanup(struct scull_dev *dev);
+void    scull_drain_pool(struct scull_dev *dev);
+int     scull_open_file(struct file *filp, struct scull_dev *dev);
+struct eventfd_ctx;
+int     scull_set_eventfd(struct eventfd_ctx **ctxp, int fd);
+
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
 long     scull_ioctl(struct file *filp,
                     unsigned int cmd, unsigned long arg);
+long    scull_dev_ioctl(struct file *filp,
+                    unsigned int cmd, unsigned long arg);
+
+#endif /* __KERNEL__ */
 
 
 /*
@@ -183,8 +314,198 @@ long     scull_ioctl(struct file *filp,
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+
+/*
+ * Order statistics for scullsort. None of these consume data; values
+ * are exchanged as ints holding a char, compared the way the device
+ * sorts them (plain char, so signed on most architectures).
+ */
+struct scull_sort_range {
+	int lo, hi;		/* inclusive bounds */
+	unsigned int count;	/* elements in [lo, hi], set by the driver */
+};
+
+#define SCULL_SORT_IOCQCOUNT    _IO(SCULL_IOC_MAGIC,   15)
+#define SCULL_SORT_IOCGMIN      _IOR(SCULL_IOC_MAGIC,  16, int)
+#define SCULL_SORT_IOCGMAX      _IOR(SCULL_IOC_MAGIC,  17, int)
+#define SCULL_SORT_IOCXKTH      _IOWR(SCULL_IOC_MAGIC, 18, int) /* k -> value */
+#define SCULL_SORT_IOCXRANK     _IOWR(SCULL_IOC_MAGIC, 19, int) /* value -> rank */
+#define SCULL_SORT_IOCXRANGE    _IOWR(SCULL_IOC_MAGIC, 20, struct scull_sort_range)
+#define SCULL_SORT_IOCXQUANTILE _IOWR(SCULL_IOC_MAGIC, 21, int) /* permille -> value */
+
+/*
+ * Per-file read modes for scullsort. Reads still consume what they return:
+ * RANGE only returns (and removes) elements within [lo, hi], UNIQUE returns
+ * each distinct value once, and PAIRS returns struct scull_sort_pair records
+ * in place of runs of equal elements.
+ */
+#define SCULL_SORT_READ_ALL    0
+#define SCULL_SORT_READ_RANGE  1
+#define SCULL_SORT_READ_UNIQUE 2
+#define SCULL_SORT_READ_PAIRS  3
+
+struct scull_sort_readmode {
+	int mode;
+	int lo, hi;		/* inclusive bounds, RANGE only */
+};
+
+struct scull_sort_pair {
+	int value;
+	unsigned int count;
+};
+
+#define SCULL_SORT_IOCSREADMODE _IOW(SCULL_IOC_MAGIC,  22, struct scull_sort_readmode)
+#define SCULL_SORT_IOCGREADMODE _IOR(SCULL_IOC_MAGIC,  23, struct scull_sort_readmode)
+
+/*
+ * Per-file write flags for scullsort. With WRITE_RUN set, every write is
+ * taken to be an already sorted run, which saves the device from sorting it
+ * again; runs that turn out not to be sorted are accepted as plain data.
+ */
+#define SCULL_SORT_WRITE_RUN   1
+
+#define SCULL_SORT_IOCTWFLAGS   _IO(SCULL_IOC_MAGIC,   24)
+#define SCULL_SORT_IOCQWFLAGS   _IO(SCULL_IOC_MAGIC,   25)
+
+/*
+ * scullmerge reads the scullsort devices selected by a bitmask
+ * (bit n for scullsortn) as one ordered stream.
+ */
+#define SCULL_MERGE_IOCTMEMBERS _IO(SCULL_IOC_MAGIC,   26)
+#define SCULL_MERGE_IOCQMEMBERS _IO(SCULL_IOC_MAGIC,   27)
+
+/*
+ * Snapshots of a scullsort device, for carrying its contents across a
+ * module reload. A snapshot is a struct scull_sort_snap_header followed by
+ * the elements in sorted order. EXPORT leaves the device untouched; if the
+ * buffer is too small it fails with ENOSPC and size says how much is needed.
+ * IMPORT only goes into an empty device, and refuses unsorted data.
+ */
+#define SCULL_SORT_SNAP_MAGIC  0x53534e31    /* "SSN1" */
+
+struct scull_sort_snap_header {
+	unsigned int magic;
+	unsigned int count;     /* elements following the header */
+};
+
+struct scull_sort_snapshot {
+	unsigned int size;      /* bytes at data; bytes used, on return */
+	void *data;
+};
+
+#define SCULL_SORT_IOCXEXPORT   _IOWR(SCULL_IOC_MAGIC, 28, struct scull_sort_snapshot)
+#define SCULL_SORT_IOCSIMPORT   _IOW(SCULL_IOC_MAGIC,  29, struct scull_sort_snapshot)
+
+/*
+ * Buffer size of one scullpipe device, unlike SCULL_P_IOCTSIZE which sets
+ * the default for all of them. Data already buffered is kept; sizes are
+ * rounded up to a power of two.
+ */
+#define SCULL_P_IOCTBUFSIZE     _IO(SCULL_IOC_MAGIC,   30)
+#define SCULL_P_IOCQBUFSIZE     _IO(SCULL_IOC_MAGIC,   31)
+
+/*
+ * Broadcast mode of a scullpipe device: every reader gets every byte,
+ * instead of readers competing for them. Only settable while the device
+ * is not open for reading.
+ */
+#define SCULL_P_BCAST_OFF       0   /* readers compete, as always */
+#define SCULL_P_BCAST_ON        1   /* writers wait for the slowest reader */
+#define SCULL_P_BCAST_DROP      2   /* ... or skip it ahead, reads get EPIPE */
+
+#define SCULL_P_IOCTBCAST       _IO(SCULL_IOC_MAGIC,   32)
+#define SCULL_P_IOCQBCAST       _IO(SCULL_IOC_MAGIC,   33)
+
+/*
+ * Packet mode of a scullpipe device: each write is one message and each
+ * read returns one whole message, the part that does not fit being lost.
+ * Only settable while the device is empty and not open for reading.
+ * SCULL_P_IOCXBATCH reads as many messages as fit, back to back, and
+ * returns how many there were.
+ */
+struct scull_p_batch {
+	void *data;             /* the messages */
+	unsigned int size;      /* room at data */
+	unsigned int *lens;     /* their lengths */
+	unsigned int nlens;     /* room at lens, in entries */
+};
+
+#define SCULL_P_IOCTPACKET      _IO(SCULL_IOC_MAGIC,   34)
+#define SCULL_P_IOCQPACKET      _IO(SCULL_IOC_MAGIC,   35)
+#define SCULL_P_IOCXBATCH       _IOWR(SCULL_IOC_MAGIC, 36, struct scull_p_batch)
+
+/*
+ * Low-watermarks of one open scullpipe file, as with SO_RCVLOWAT and
+ * SO_SNDLOWAT: a blocking read sleeps until rcvlowat bytes are there, or
+ * until rcvtimeo ms have passed and anything is, and a blocking write until
+ * sndlowat bytes are free. Both default to 1 and are cut down to the size
+ * of the request. Packet mode ignores them.
+ */
+struct scull_p_lowat {
+	unsigned int rcvlowat;
+	unsigned int sndlowat;
+	unsigned int rcvtimeo;  /* 0 waits for rcvlowat forever */
+};
+
+#define SCULL_P_IOCSLOWAT       _IOW(SCULL_IOC_MAGIC,  37, struct scull_p_lowat)
+#define SCULL_P_IOCGLOWAT       _IOR(SCULL_IOC_MAGIC,  38, struct scull_p_lowat)
+
+/*
+ * Register an eventfd with a scullpipe or scullsort device, -1 to drop it.
+ * Every write adds what it made readable to the eventfd's count: bytes,
+ * messages in packet mode, or elements. It is dropped on the last close.
+ */
+#define SCULL_IOCTEVENTFD       _IO(SCULL_IOC_MAGIC,   39)
+
+/*
+ * Ranges of a bare scull device, which may be sparse: holes are quanta
+ * never written, found with SEEK_DATA and SEEK_HOLE, and read as zeros.
+ * PUNCH frees the quanta entirely within the range and zeroes the rest
+ * of it (EBUSY if the device is mapped); PREALLOC fills in every quantum
+ * the range touches, zeroed, so later writes there don't allocate (EFBIG
+ * past the largest file offset, ENOSPC for more than SCULL_PREALLOC_MAX).
+ * Neither changes the size of the device, and both take an fd open for
+ * writing (EBADF otherwise).
+ */
+struct scull_range {
+	unsigned long offset;
+	unsigned long length;
+};
+
+#define SCULL_IOCSPUNCH         _IOW(SCULL_IOC_MAGIC,  40, struct scull_range)
+#define SCULL_IOCSPREALLOC      _IOW(SCULL_IOC_MAGIC,  41, struct scull_range)
+
+/*
+ * Geometry of one bare scull device, unlike SCULL_IOCSQUANTUM and friends
+ * which set the default for all of them. It is what the device uses from
+ * its next trim on, or right away if it holds no data; zero means the
+ * default, and SCULL_QUANTUM_AUTO has the device size its quanta itself.
+ * Setting it takes an fd open for writing (EBADF otherwise), a quantum up
+ * to SCULL_AUTO_MAX and a qset up to SCULL_QSET_MAX.
+ */
+#define SCULL_QUANTUM_AUTO      (-1)
+
+struct scull_geometry {
+	int quantum;            /* bytes, SCULL_QUANTUM_AUTO or 0 */
+	int qset;               /* quanta per set, or 0 */
+	int cur_quantum;        /* in use now; ignored when setting */
+	int cur_qset;
+};
+
+#define SCULL_IOCSGEOMETRY      _IOW(SCULL_IOC_MAGIC,  42, struct scull_geometry)
+#define SCULL_IOCGGEOMETRY      _IOR(SCULL_IOC_MAGIC,  43, struct scull_geometry)
+
+/*
+ * Make the device a point-in-time copy of the bare scull device open on
+ * the fd passed as argument. Its data is dropped first, and from then on
+ * the two share their quanta, each being copied only when either device
+ * writes to it. Neither device may be mapped, and neither can be mapped
+ * until it has been trimmed again. The device must be open for writing
+ * and the other one for reading (EBADF otherwise).
+ */
+#define SCULL_IOCTSNAPSHOT      _IO(SCULL_IOC_MAGIC,   44)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 44
 
 #endif /* _SCULL_H_ */
@@ -24,10 +24,33 @@
 
 #include <linux/delay.h>
 #include <linux/sort.h>
+#include <linux/highmem.h>    /* kmap_atomic() */
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/uio.h>          /* iov_iter */
+#include <linux/eventfd.h>
 
 
 #include "scull.h"        /* local definitions */
 
+// Elements are plain chars, which sort() compares signed on most platforms.
+//  SORT_KEY maps an element to its position in that order so that the index
+//  below can be laid out as an array, SORT_VALUE maps it back.
+#define SORT_KEYS       256
+#define SORT_SIGNED     ((char)-1 < 0)
+#define SORT_KEY(c)     ((unsigned char)(c) ^ (SORT_SIGNED ? 0x80 : 0))
+#define SORT_VALUE(k)   ((char)((k) ^ (SORT_SIGNED ? 0x80 : 0)))
+
+// The unread part of the buffer is a sequence of runs, in the order they were
+//  written. Writes flagged SCULL_SORT_WRITE_RUN arrive already sorted and are
+//  kept as they are; reads sort whatever is not, then merge the runs.
+#define SORT_MAX_RUNS   16
+
+struct sort_run {
+        int len;
+        bool sorted;
+};
+
 struct scull_sort {
         wait_queue_head_t inq, outq;        /* read and write queues */
         char *buffer, *end;                 /* begin of buf, end of buf */
@@ -35,22 +58,51 @@ struct scull_sort {
         char *rp, *wp;                      /* not a circular queue */
         int nreaders, nwriters;             /* number of openings for r/w */
         struct fasync_struct *async_queue;  /* asynchronous readers */
+        struct eventfd_ctx *eventfd;        /* signalled under the mutex */
         struct mutex mutex;                 /* mutual exclusion semaphore */
         struct cdev cdev;                   /* Char device structure */
+        unsigned int index[SORT_KEYS + 1];  /* Fenwick tree of key counts */
+        char *scratch;                      /* merge target, swapped with buffer */
+        struct sort_run runs[SORT_MAX_RUNS];/* [rp, wp) split into runs */
+        int nruns;
 };
 
+// per-open state, hung off filp->private_data
+struct scull_sort_file {
+        struct scull_sort *dev;             /* the device this file belongs to */
+        int mode;                           /* SCULL_SORT_READ_* */
+        int wflags;                         /* SCULL_SORT_WRITE_* */
+        int lo, hi;                         /* keys, for SCULL_SORT_READ_RANGE */
+};
+
+// read modes process this many elements per copy_to_user
+#define SORT_CHUNK      64
+
 /* parameters */
+int scull_sort_nr_devs = SCULL_SORT_NR_DEVS;    // number of sort devices
 int sort_buffer =  SCULL_SORT_BUFFER;   // size of buffer
 dev_t scull_sort_devno;                 // device number
 static bool sort_initialized = false;   // first-time operations
-static bool sort_sorted = false;        // sort before next read?
 
-static struct scull_sort my_dev;        // device data
+module_param(scull_sort_nr_devs, int, 0);
+
+static struct scull_sort *scull_sort_devices;   // device data
 
 static int scull_sort_fasync(int fd, struct file *filp, int mode);
-static int spacefree(void);
-void print_stuff(void);
-void scull_shift_buffer(void);
+static int spacefree(struct scull_sort *dev);
+void print_stuff(struct scull_sort *dev);
+void scull_shift_buffer(struct scull_sort *dev);
+static void sort_index_insert(struct scull_sort *dev, const char *elems, int count);
+static void sort_index_drop(struct scull_sort *dev, const char *from,
+                            unsigned int count);
+static unsigned int sort_available(struct scull_sort_file *sfile);
+static ssize_t sort_read_range(struct scull_sort_file *sfile,
+                               struct iov_iter *to);
+static ssize_t sort_read_unique(struct scull_sort *dev, struct iov_iter *to);
+static ssize_t sort_read_pairs(struct scull_sort *dev, struct iov_iter *to);
+static void sort_run_append(struct scull_sort *dev, const char *elems,
+                            int count, bool sorted);
+static void sort_runs_merge(struct scull_sort *dev);
 
 
 
@@ -60,34 +112,52 @@ void scull_shift_buffer(void);
 
 // open scullsort device
 static int scull_sort_open(struct inode *inode, struct file *filp) {
+    struct scull_sort *dev = container_of(inode->i_cdev, struct scull_sort, cdev);
+    struct scull_sort_file *sfile;
     printk("\nOpening scullsort\n");
-    print_stuff();
+    print_stuff(dev);
+    
+    // every opening starts out reading everything, in order
+    sfile = kzalloc(sizeof(struct scull_sort_file), GFP_KERNEL);
+    if (!sfile)
+        return -ENOMEM;
+    sfile->dev  = dev;
+    sfile->mode = SCULL_SORT_READ_ALL;
+    filp->private_data = sfile;
+    filp->f_mode |= FMODE_NOWAIT;       // read_iter and write_iter honor it
     
     // sleep (retry call) until lock acquired
-    if (mutex_lock_interruptible(&my_dev.mutex))
+    if (mutex_lock_interruptible(&dev->mutex)) {
+        kfree(sfile);
         return -ERESTARTSYS;
+    }
 
-    if (filp->f_mode & FMODE_READ)  my_dev.nreaders++;
-    if (filp->f_mode & FMODE_WRITE) my_dev.nwriters++;
+    if (filp->f_mode & FMODE_READ)  dev->nreaders++;
+    if (filp->f_mode & FMODE_WRITE) dev->nwriters++;
     
-    mutex_unlock(&my_dev.mutex);
+    mutex_unlock(&dev->mutex);
     
     return nonseekable_open(inode, filp);
 }
 
 // close scullsort device
 static int scull_sort_release(struct inode *inode, struct file *filp) {
+    struct scull_sort_file *sfile = filp->private_data;
+    struct scull_sort *dev = sfile->dev;
     printk("Releasing scullsort\n");
     
     scull_sort_fasync(-1, filp, 0);
-    mutex_lock(&my_dev.mutex);
+    mutex_lock(&dev->mutex);
     
-    if (filp->f_mode & FMODE_READ)  my_dev.nreaders--;
-    if (filp->f_mode & FMODE_WRITE) my_dev.nwriters--;
+    if (filp->f_mode & FMODE_READ)  dev->nreaders--;
+    if (filp->f_mode & FMODE_WRITE) dev->nwriters--;
+    if (dev->nreaders + dev->nwriters == 0)
+        scull_set_eventfd(&dev->eventfd, -1);
     
-    mutex_unlock(&my_dev.mutex);
+    mutex_unlock(&dev->mutex);
     
-    print_stuff();
+    print_stuff(dev);
+    kfree(sfile);
     return 0;
 }
 
@@ -97,67 +167,98 @@ static int compare_helper(const void*a, const void*b) {
 }
 
 // gets size of usable space in buffer
-static int spacefree(void) {
-    if (my_dev.wp == my_dev.rp) return my_dev.buffersize-1;
+static int spacefree(struct scull_sort *dev) {
+    if (dev->wp == dev->rp) return dev->buffersize-1;
     
-    return ((my_dev.buffersize + my_dev.buffer) - my_dev.wp) -1;
+    return ((dev->buffersize + dev->buffer) - dev->wp) -1;
+}
+
+// whether the caller asked not to be put to sleep
+static bool sort_nowait(struct kiocb *iocb) {
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+           (iocb->ki_flags & IOCB_NOWAIT);
 }
 
 // read stuff
 // The read pointer will be incremented so as to prevent unneeded shifting
 // If more than a quarter of the buffer space is unusable, then the data will
 //  be shifted and the pointers moved.
-static ssize_t scull_sort_read (struct file *filp, char __user *buf,
-                                size_t count,      loff_t *f_pos)
+// Works on a whole iov_iter, so every segment of a readv() is filled under
+//  one acquisition of the lock.
+static ssize_t scull_sort_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
+    struct file *filp = iocb->ki_filp;
+    struct scull_sort_file *sfile = filp->private_data;
+    struct scull_sort *dev = sfile->dev;
+    size_t want, count;
+    ssize_t ret;
     printk("Read: waiting\n");
-    //print_stuff();
+    //print_stuff(dev);
     
-    // sleep (retry call) until lock acquired
-    if (mutex_lock_interruptible(&my_dev.mutex))
-        return -ERESTARTSYS;
+    // sleep (retry call) until lock acquired, unless told not to
+    ret = scull_lock_iocb(&dev->mutex, iocb);
+    if (ret)
+        return ret;
     printk("Reading from scullsort\n");
             
-    while (my_dev.rp == my_dev.wp) {    // while there is nothing to read
-        mutex_unlock(&my_dev.mutex);        //  free the lock
+    while (!sort_available(sfile)) {    // while there is nothing to read
+        mutex_unlock(&dev->mutex);        //  free the lock
         
         // exit if non-blocking
-        if (filp->f_flags & O_NONBLOCK) {
+        if (sort_nowait(iocb)) {
             printk("No blocking allowed!\n");
             return -EAGAIN;
         }
         
         // sleep (retry call) until there is something to read
-        if (wait_event_interruptible(my_dev.inq, (my_dev.rp != my_dev.wp)))
+        if (wait_event_interruptible(dev->inq, sort_available(sfile)))
             return -ERESTARTSYS;
         
         // re-acquire mutex
-        if (mutex_lock_interruptible(&my_dev.mutex))
+        if (mutex_lock_interruptible(&dev->mutex))
             return -ERESTARTSYS;
     }
     
     
-    // sort array
-    sort(my_dev.rp, my_dev.wp - my_dev.rp, sizeof(char), compare_helper, NULL);
-    sort_sorted = true;
+    // bring the buffer down to a single sorted run
+    sort_runs_merge(dev);
     
     // there is now data to be read, and it is safe to read the data
-    count = min(count, (size_t)(my_dev.wp - my_dev.rp));
-    if ( copy_to_user(buf, my_dev.rp, count) ) {
-        mutex_unlock(&my_dev.mutex);
-        return -EFAULT;
+    switch (sfile->mode) {
+      case SCULL_SORT_READ_RANGE:
+        ret = sort_read_range(sfile, to);
+        break;
+      case SCULL_SORT_READ_UNIQUE:
+        ret = sort_read_unique(dev, to);
+        break;
+      case SCULL_SORT_READ_PAIRS:
+        ret = sort_read_pairs(dev, to);
+        break;
+      default:
+        want = min(iov_iter_count(to), (size_t)(dev->wp - dev->rp));
+        count = copy_to_iter(dev->rp, want, to);
+        if (want && !count) {
+            ret = -EFAULT;
+            break;
+        }
+        sort_index_drop(dev, dev->rp, count);
+        dev->rp += count;
+        ret = count;
     }
-    my_dev.rp += count;
+    
+    // whatever was consumed, what remains is still one sorted run
+    dev->nruns = (dev->rp != dev->wp);
+    dev->runs[0].len = dev->wp - dev->rp;
     
     // if lots of space is wasted, clean it up
-    if ((my_dev.rp - my_dev.buffer) > (sort_buffer >>2)) {
-        scull_shift_buffer();
+    if ((dev->rp - dev->buffer) > (sort_buffer >>2)) {
+        scull_shift_buffer(dev);
     }
     
-    mutex_unlock(&my_dev.mutex);
+    mutex_unlock(&dev->mutex);
+    wake_up_interruptible(&dev->outq);
     
-    return count;
-    wake_up_interruptible(&my_dev.outq);
+    return ret;
 }
 
 
@@ -165,27 +266,31 @@ static ssize_t scull_sort_read (struct file *filp, char __user *buf,
 // perform write operations
 // Prior to each write, the values will be shifted to maximize number written.
 //  Also, the buffer will be sorted after recieving values from user.
-static ssize_t scull_sort_write(struct file *filp, const char __user *buf,
-                                size_t count,      loff_t *f_pos)
+// Like reads, takes a whole iov_iter so a writev() is one locked operation.
+static ssize_t scull_sort_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
+    struct scull_sort_file *sfile = iocb->ki_filp->private_data;
+    struct scull_sort *dev = sfile->dev;
+    bool sorted = sfile->wflags & SCULL_SORT_WRITE_RUN;
+    size_t count = iov_iter_count(from);
     int val;
     size_t ret=0;
     printk("Write: waiting\n");
-    //print_stuff();
+    //print_stuff(dev);
     
-    // sleep (retry call) until lock acquired
-    if (mutex_lock_interruptible(&my_dev.mutex))
-        return -ERESTARTSYS;
+    // sleep (retry call) until lock acquired, unless told not to
+    if ((val = scull_lock_iocb(&dev->mutex, iocb)))
+        return val;
     printk("Write: preparing\n");
     
     
     // free up some space
-    scull_shift_buffer();
+    scull_shift_buffer(dev);
     
     // wait for space to write
-    if ((val = spacefree()) < count) {
-        mutex_unlock(&my_dev.mutex);
-        if (filp->f_flags & O_NONBLOCK) {
+    if ((val = spacefree(dev)) < count) {
+        mutex_unlock(&dev->mutex);
+        if (sort_nowait(iocb)) {
             printk("No blocking allowed!\n");    
             return -EAGAIN;
         }
@@ -194,53 +299,172 @@ static ssize_t scull_sort_write(struct file *filp, const char __user *buf,
             if (signal_pending(current))
                 return ret;
                 
-            printk("Waiting for space... %d/%d\n", spacefree(), count);
-            if (mutex_lock_interruptible(&my_dev.mutex))
+            printk("Waiting for space... %d/%d\n", spacefree(dev), count);
+            if (mutex_lock_interruptible(&dev->mutex))
                 return ret;
             
             // perform incremental writes on whatever space is available
-            val = min(count, (size_t)(spacefree()));
-            if (copy_from_user(my_dev.wp, buf, val)) {
-                mutex_unlock(&my_dev.mutex);
+            val = min(count, (size_t)(spacefree(dev)));
+            if (copy_from_iter(dev->wp, val, from) != val) {
+                mutex_unlock(&dev->mutex);
                 return -EFAULT;
             }
+            sort_index_insert(dev, dev->wp, val);
+            sort_run_append(dev, dev->wp, val, sorted);
             printk("Wrote %ld\n", (long)val);
             count       -= val;
             ret         += val;
-            my_dev.wp   += val;
-            val         = spacefree();
+            dev->wp   += val;
+            if (dev->eventfd)
+                eventfd_signal(dev->eventfd, val);
+            val         = spacefree(dev);
             
-            sort_sorted = false;
-            mutex_unlock(&my_dev.mutex);
+            mutex_unlock(&dev->mutex);
             
 
             msleep(2000);
         }
-        mutex_lock(&my_dev.mutex);
+        mutex_lock(&dev->mutex);
     }
      
     
-    printk("Writing to scullsort - %d\n", spacefree());
+    printk("Writing to scullsort - %d\n", spacefree(dev));
     // there exists space to write to and a lock is held, so start writing
 //    count = min(count, (size_t)(spacefree));
-    if (copy_from_user(my_dev.wp, buf, count)) {
-        mutex_unlock(&my_dev.mutex);
+    if (copy_from_iter(dev->wp, count, from) != count) {
+        mutex_unlock(&dev->mutex);
         return -EFAULT;
     }
-    my_dev.wp   += count;
+    sort_index_insert(dev, dev->wp, count);
+    sort_run_append(dev, dev->wp, count, sorted);
+    dev->wp   += count;
     ret         += count;
+    if (dev->eventfd)
+        eventfd_signal(dev->eventfd, count);
     
-    sort_sorted = false;
-    mutex_unlock(&my_dev.mutex);
-    wake_up_interruptible(&my_dev.inq);
-    if (my_dev.async_queue)
-        kill_fasync(&my_dev.async_queue, SIGIO, POLL_IN);
+    mutex_unlock(&dev->mutex);
+    wake_up_interruptible(&dev->inq);
+    scull_merge_wake();
+    if (dev->async_queue)
+        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
     
     return ret;
 }
 
 
 
+//=============================================================================
+//                                 Splice
+//=============================================================================
+
+// total room for writing once the buffer has been shifted
+//  fine to call unlocked as a wakeup condition
+static int sort_space(struct scull_sort *dev) {
+    return dev->buffersize - 1 - (dev->wp - dev->rp);
+}
+
+// splices sorted elements out, through scull_splice_out in pipe.c
+// The other read modes reshape what they return, so only plain reads are
+//  offered; the pipe takes the elements as one copy into its own pages.
+static ssize_t scull_sort_splice_read(struct file *filp, loff_t *ppos,
+                                      struct pipe_inode_info *pipe,
+                                      size_t len, unsigned int flags)
+{
+    struct scull_sort_file *sfile = filp->private_data;
+    struct scull_sort *dev = sfile->dev;
+    struct kvec vec;
+    ssize_t ret;
+    
+    if (sfile->mode != SCULL_SORT_READ_ALL)
+        return -EINVAL;
+    if (mutex_lock_interruptible(&dev->mutex))
+        return -ERESTARTSYS;
+    
+    while (!sort_available(sfile)) {    // while there is nothing to read
+        mutex_unlock(&dev->mutex);
+        if ((filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK))
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->inq, sort_available(sfile)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&dev->mutex))
+            return -ERESTARTSYS;
+    }
+    
+    sort_runs_merge(dev);
+    vec.iov_base = dev->rp;
+    vec.iov_len  = min_t(size_t, len, dev->wp - dev->rp);
+    vec.iov_len  = min_t(size_t, vec.iov_len, PIPE_DEF_BUFFERS * PAGE_SIZE);
+    
+    // only what the pipe actually took is consumed
+    ret = scull_splice_out(pipe, &vec, 1);
+    if (ret > 0)
+        scull_sort_consume(dev, ret);
+    if ((dev->rp - dev->buffer) > (sort_buffer >>2))
+        scull_shift_buffer(dev);
+    
+    mutex_unlock(&dev->mutex);
+    
+    return ret;
+}
+
+// copies one pipe buffer, or as much of it as fits, into the sort buffer
+static int scull_sort_splice_actor(struct pipe_inode_info *pipe,
+                                   struct pipe_buffer *buf,
+                                   struct splice_desc *sd)
+{
+    struct file *filp = sd->u.file;
+    struct scull_sort_file *sfile = filp->private_data;
+    struct scull_sort *dev = sfile->dev;
+    char *addr;
+    int count;
+    
+    for (;;) {
+        if (mutex_lock_interruptible(&dev->mutex))
+            return -ERESTARTSYS;
+        scull_shift_buffer(dev);
+        count = min_t(int, sd->len, spacefree(dev));
+        if (count)
+            break;
+        
+        // full, so wait for a reader to make room
+        mutex_unlock(&dev->mutex);
+        if ((filp->f_flags & O_NONBLOCK) || (sd->flags & SPLICE_F_NONBLOCK))
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->outq, sort_space(dev)))
+            return -ERESTARTSYS;
+    }
+    
+    addr = kmap_atomic(buf->page);
+    memcpy(dev->wp, addr + buf->offset, count);
+    kunmap_atomic(addr);
+    sort_index_insert(dev, dev->wp, count);
+    sort_run_append(dev, dev->wp, count, sfile->wflags & SCULL_SORT_WRITE_RUN);
+    dev->wp += count;
+    if (dev->eventfd)
+        eventfd_signal(dev->eventfd, count);
+    
+    mutex_unlock(&dev->mutex);
+    wake_up_interruptible(&dev->inq);
+    scull_merge_wake();
+    if (dev->async_queue)
+        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+    
+    return count;
+}
+
+// splices elements in, one copy from the pipe's pages into the buffer
+//  Pages gifted through vmsplice are copied as well, there being no place
+//  for a whole page in the middle of the sort buffer.
+static ssize_t scull_sort_splice_write(struct pipe_inode_info *pipe,
+                                       struct file *filp, loff_t *ppos,
+                                       size_t len, unsigned int flags)
+{
+    return splice_from_pipe(pipe, filp, ppos, len, flags,
+                            scull_sort_splice_actor);
+}
+
+
+
 //=============================================================================
 //                              Poll & Async
 //=============================================================================
@@ -252,9 +476,469 @@ static unsigned int scull_sort_poll(struct file *filp, poll_table *wait) {
 }
 
 static int scull_sort_fasync(int fd, struct file *filp, int mode) {
+    struct scull_sort_file *sfile = filp->private_data;
 //    printk("Async scullsort...\n");
     
-    return fasync_helper(fd, filp, mode, &my_dev.async_queue);
+    return fasync_helper(fd, filp, mode, &sfile->dev->async_queue);
+}
+
+
+
+//=============================================================================
+//                            Order Statistics
+//=============================================================================
+
+// The index is a Fenwick tree of per-key element counts, updated as elements
+//  are written and read. It answers rank and k-th smallest queries in
+//  O(log SORT_KEYS) without looking at, or sorting, the buffer itself.
+//  None of these take a lock, the caller is expected to hold it.
+
+static void sort_index_add(struct scull_sort *dev, int key, int delta) {
+    int i;
+
+    for (i = key + 1; i <= SORT_KEYS; i += i & -i)
+        dev->index[i] += delta;
+}
+
+// number of elements with a key strictly below the given one
+static unsigned int sort_index_below(struct scull_sort *dev, int key) {
+    unsigned int total = 0;
+    int i;
+
+    for (i = key; i > 0; i -= i & -i)
+        total += dev->index[i];
+    return total;
+}
+
+// key of the k-th smallest element, counting from zero
+//  k must be less than the number of elements in the buffer
+static int sort_index_kth(struct scull_sort *dev, unsigned int k) {
+    int pos = 0, step;
+
+    for (step = SORT_KEYS; step; step >>= 1) {
+        if (pos + step <= SORT_KEYS && dev->index[pos + step] <= k) {
+            pos += step;
+            k   -= dev->index[pos];
+        }
+    }
+    return pos;
+}
+
+static void sort_index_insert(struct scull_sort *dev, const char *elems, int count) {
+    while (count--)
+        sort_index_add(dev, SORT_KEY(*elems++), 1);
+}
+
+// drops count elements starting at from, which must lie in the sorted buffer
+//  Works a run of equal keys at a time, so the cost depends on how many
+//  distinct values are dropped rather than on how many elements.
+static void sort_index_drop(struct scull_sort *dev, const char *from,
+                            unsigned int count) {
+    unsigned int pos = from - dev->rp, end = pos + count;
+    unsigned int next, dropped = 0;
+    int key;
+
+    while (pos < end) {
+        key  = SORT_KEY(dev->rp[pos]);
+        next = min(end, sort_index_below(dev, key + 1) + dropped);
+        sort_index_add(dev, key, -(int)(next - pos));
+        dropped += next - pos;
+        pos = next;
+    }
+}
+
+// values come in from userspace as ints, but must fit the element type
+static bool sort_value_ok(int value) {
+    return (char)value == value;
+}
+
+// answers the single-value queries, leaving the answer in *val
+//  does not take a lock, assumes caller is holding one
+static long sort_query(struct scull_sort *dev, unsigned int cmd, int *val) {
+    unsigned int n = dev->wp - dev->rp;
+    unsigned int k;
+
+    if (cmd == SCULL_SORT_IOCXRANK) {
+        if (!sort_value_ok(*val))
+            return -EINVAL;
+        *val = sort_index_below(dev, SORT_KEY(*val));
+        return 0;
+    }
+    if (n == 0)
+        return -ENODATA;
+
+    switch (cmd) {
+      case SCULL_SORT_IOCGMIN:
+        k = 0;
+        break;
+      case SCULL_SORT_IOCGMAX:
+        k = n - 1;
+        break;
+      case SCULL_SORT_IOCXKTH:
+        if (*val < 0 || *val >= n)
+            return -EINVAL;
+        k = *val;
+        break;
+      case SCULL_SORT_IOCXQUANTILE:     // nearest-rank, in permille
+        if (*val < 0 || *val > 1000)
+            return -EINVAL;
+        k = ((unsigned long)*val * n + 999) / 1000;
+        if (k) k--;
+        break;
+      default:
+        return -ENOTTY;
+    }
+    *val = SORT_VALUE(sort_index_kth(dev, k));
+    return 0;
+}
+
+
+
+//=============================================================================
+//                                  Runs
+//=============================================================================
+
+// records count elements just copied in at elems (the write pointer)
+//  A run claimed to be sorted is checked with one linear pass; if it turns out
+//  not to be, it is simply kept as unsorted data. A sorted run that continues
+//  the previous one is folded into it, and once the table is full everything
+//  else lands in the last run, which then has to be sorted on the next read.
+//  does not take a lock, assumes caller is holding one
+static void sort_run_append(struct scull_sort *dev, const char *elems,
+                            int count, bool sorted) {
+    struct sort_run *last = dev->nruns ? &dev->runs[dev->nruns - 1] : NULL;
+    int i;
+
+    if (count <= 0)
+        return;
+    for (i = 1; sorted && i < count; i++)
+        sorted = elems[i - 1] <= elems[i];
+
+    if (last && last->sorted == sorted && (!sorted || elems[-1] <= elems[0])) {
+        last->len += count;
+        return;
+    }
+    if (dev->nruns == SORT_MAX_RUNS) {
+        last->len += count;
+        last->sorted = false;
+        return;
+    }
+    dev->runs[dev->nruns].len = count;
+    dev->runs[dev->nruns].sorted = sorted;
+    dev->nruns++;
+}
+
+struct sort_cursor {
+    const char *pos, *end;
+};
+
+// restores the heap property below slot i of a min-heap of run cursors
+static void sort_heap_down(struct sort_cursor *heap, int n, int i) {
+    struct sort_cursor tmp;
+    int child;
+
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && *heap[child + 1].pos < *heap[child].pos)
+            child++;
+        if (*heap[i].pos <= *heap[child].pos)
+            break;
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+// turns the unread data into a single sorted run
+//  Unsorted runs are sorted on their own, then all runs are merged into the
+//  scratch buffer through a heap of cursors, O(n log k) for k runs. The two
+//  buffers then trade places, which also leaves the data shifted to the front.
+//  does not take a lock, assumes caller is holding one
+static void sort_runs_merge(struct scull_sort *dev) {
+    struct sort_cursor heap[SORT_MAX_RUNS];
+    char *pos = dev->rp, *out, *tmp;
+    int i, n = 0, count = dev->wp - dev->rp;
+
+    if (dev->nruns == 0)
+        return;
+    if (!dev->scratch && dev->nruns > 1) {
+        // nowhere to merge into, so fall back to sorting it all in place
+        dev->runs[0].len = count;
+        dev->runs[0].sorted = false;
+        dev->nruns = 1;
+    }
+
+    for (i = 0; i < dev->nruns; i++) {
+        if (!dev->runs[i].sorted)
+            sort(pos, dev->runs[i].len, sizeof(char), compare_helper, NULL);
+        heap[n].pos = pos;
+        heap[n].end = pos + dev->runs[i].len;
+        pos += dev->runs[i].len;
+        n++;
+    }
+    if (n > 1) {
+        for (i = n / 2 - 1; i >= 0; i--)
+            sort_heap_down(heap, n, i);
+        for (out = dev->scratch; n; out++) {
+            *out = *heap[0].pos++;
+            if (heap[0].pos == heap[0].end)
+                heap[0] = heap[--n];
+            sort_heap_down(heap, n, 0);
+        }
+
+        tmp = dev->buffer;
+        dev->buffer  = dev->scratch;
+        dev->scratch = tmp;
+        dev->end = dev->buffer + dev->buffersize;
+        dev->rp  = dev->buffer;
+        dev->wp  = dev->buffer + count;
+    }
+
+    dev->runs[0].len = count;
+    dev->runs[0].sorted = true;
+    dev->nruns = 1;
+}
+
+
+
+//=============================================================================
+//                               Read Modes
+//=============================================================================
+
+// The helpers below run with the lock held and the buffer sorted, so every
+//  value occupies one contiguous run whose bounds the index can tell us
+//  without walking through the duplicates.
+
+// number of elements a read on this file would be able to return
+static unsigned int sort_available(struct scull_sort_file *sfile) {
+    struct scull_sort *dev = sfile->dev;
+
+    if (sfile->mode == SCULL_SORT_READ_RANGE)
+        return sort_index_below(dev, sfile->hi + 1) - sort_index_below(dev, sfile->lo);
+    return dev->wp - dev->rp;
+}
+
+// returns only the elements within [lo, hi], leaving the rest in place
+//  The gap left behind is closed by moving whichever side of it is smaller.
+static ssize_t sort_read_range(struct scull_sort_file *sfile,
+                               struct iov_iter *to) {
+    struct scull_sort *dev = sfile->dev;
+    unsigned int before = sort_index_below(dev, sfile->lo);
+    unsigned int after;
+    char *from = dev->rp + before;
+    size_t want, count;
+    
+    want = min(iov_iter_count(to), (size_t)sort_available(sfile));
+    count = copy_to_iter(from, want, to);
+    if (!count)
+        return want ? -EFAULT : 0;  // nothing asked for, or nothing in range
+    sort_index_drop(dev, from, count);
+    
+    after = (dev->wp - from) - count;
+    if (before <= after) {
+        memmove(dev->rp + count, dev->rp, before);
+        dev->rp += count;
+    } else {
+        memmove(from, from + count, after);
+        dev->wp -= count;
+    }
+    return count;
+}
+
+// returns each distinct value once, consuming all of its copies
+static ssize_t sort_read_unique(struct scull_sort *dev, struct iov_iter *to) {
+    char chunk[SORT_CHUNK];
+    unsigned int pos = 0, avail = dev->wp - dev->rp;
+    size_t done = 0, count = iov_iter_count(to);
+    int n;
+    
+    while (done < count && pos < avail) {
+        for (n = 0; n < SORT_CHUNK && done + n < count && pos < avail; n++) {
+            chunk[n] = dev->rp[pos];
+            pos = sort_index_below(dev, SORT_KEY(chunk[n]) + 1);
+        }
+        if (copy_to_iter(chunk, n, to) != n) {
+            if (!done)
+                return -EFAULT;
+            break;
+        }
+        done += n;
+        sort_index_drop(dev, dev->rp, pos);
+        dev->rp += pos;
+        avail -= pos;
+        pos = 0;
+    }
+    return done;
+}
+
+// returns (value, count) pairs instead of the repeated elements themselves
+//  Reads shorter than one pair are refused, partial pairs are never returned.
+static ssize_t sort_read_pairs(struct scull_sort *dev, struct iov_iter *to) {
+    struct scull_sort_pair chunk[SORT_CHUNK / 4];
+    unsigned int pos = 0, next, avail = dev->wp - dev->rp;
+    size_t done = 0, want = iov_iter_count(to) / sizeof(struct scull_sort_pair);
+    int n, key;
+    
+    if (!want)
+        return -EINVAL;
+    while (done < want && pos < avail) {
+        for (n = 0; n < ARRAY_SIZE(chunk) && done + n < want && pos < avail; n++) {
+            key  = SORT_KEY(dev->rp[pos]);
+            next = sort_index_below(dev, key + 1);
+            chunk[n].value = dev->rp[pos];
+            chunk[n].count = next - pos;
+            pos = next;
+        }
+        if (copy_to_iter(chunk, n * sizeof(struct scull_sort_pair), to) !=
+            n * sizeof(struct scull_sort_pair)) {
+            if (!done)
+                return -EFAULT;
+            break;
+        }
+        done += n;
+        sort_index_drop(dev, dev->rp, pos);
+        dev->rp += pos;
+        avail -= pos;
+        pos = 0;
+    }
+    return done * sizeof(struct scull_sort_pair);
+}
+
+
+
+//=============================================================================
+//                                Snapshots
+//=============================================================================
+
+// A snapshot is the sorted contents behind a small header, so that restoring
+//  one is a copy, a linear order check and a linear rebuild of the index.
+//  None of these take a lock, the caller is expected to hold it.
+
+// builds the index of an empty device from the count elements at rp
+static void sort_index_build(struct scull_sort *dev, unsigned int count) {
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < count; i++)
+        dev->index[SORT_KEY(dev->rp[i]) + 1]++;
+    for (j = 1; j <= SORT_KEYS; j++)
+        if (j + (j & -j) <= SORT_KEYS)
+            dev->index[j + (j & -j)] += dev->index[j];
+}
+
+// copies the header and the sorted elements out, leaving the device as is
+//  On -ENOSPC, snap->size is set to the size the snapshot needs.
+static long sort_snap_export(struct scull_sort *dev,
+                             struct scull_sort_snapshot *snap) {
+    struct scull_sort_snap_header hdr;
+    char __user *data = (char __user *)snap->data;
+    unsigned int need;
+
+    sort_runs_merge(dev);
+    hdr.magic = SCULL_SORT_SNAP_MAGIC;
+    hdr.count = dev->wp - dev->rp;
+    need = sizeof(hdr) + hdr.count;
+    if (snap->size < need) {
+        snap->size = need;
+        return -ENOSPC;
+    }
+    if (copy_to_user(data, &hdr, sizeof(hdr)) ||
+        copy_to_user(data + sizeof(hdr), dev->rp, hdr.count))
+        return -EFAULT;
+    snap->size = need;
+    return 0;
+}
+
+// fills an empty device from a snapshot taken by sort_snap_export
+//  The elements are trusted to be sorted only after checking that they are;
+//  a snapshot that fails any check leaves the device empty.
+static long sort_snap_import(struct scull_sort *dev,
+                             struct scull_sort_snapshot *snap) {
+    struct scull_sort_snap_header hdr;
+    char __user *data = (char __user *)snap->data;
+    unsigned int i;
+
+    if (dev->wp != dev->rp)
+        return -EBUSY;
+    if (snap->size < sizeof(hdr))
+        return -EINVAL;
+    if (copy_from_user(&hdr, data, sizeof(hdr)))
+        return -EFAULT;
+    if (hdr.magic != SCULL_SORT_SNAP_MAGIC ||
+        hdr.count != snap->size - sizeof(hdr))
+        return -EINVAL;
+    if (hdr.count > dev->buffersize - 1)
+        return -ENOSPC;
+
+    dev->rp = dev->wp = dev->buffer;
+    if (copy_from_user(dev->buffer, data + sizeof(hdr), hdr.count))
+        return -EFAULT;
+    for (i = 1; i < hdr.count; i++)
+        if (dev->buffer[i - 1] > dev->buffer[i])
+            return -EINVAL;
+
+    sort_index_build(dev, hdr.count);
+    dev->wp += hdr.count;
+    dev->nruns = (hdr.count != 0);
+    dev->runs[0].len = hdr.count;
+    dev->runs[0].sorted = true;
+    return 0;
+}
+
+
+
+//=============================================================================
+//                          Merging Across Devices
+//=============================================================================
+
+// scullmerge (merge.c) reads from several sort devices at once. It does so
+//  through the functions below, which hand out the unread data in place
+//  instead of copying it.
+
+struct scull_sort *scull_sort_device(int index) {
+    if (!scull_sort_devices || index < 0 || index >= scull_sort_nr_devs)
+        return NULL;
+    return &scull_sort_devices[index];
+}
+
+// takes the lock for a read on behalf of iocb, see scull_lock_iocb
+int scull_sort_lock(struct scull_sort *dev, struct kiocb *iocb) {
+    return scull_lock_iocb(&dev->mutex, iocb);
+}
+
+void scull_sort_unlock(struct scull_sort *dev) {
+    mutex_unlock(&dev->mutex);
+}
+
+// number of unread elements; fine to call unlocked as a wakeup condition
+unsigned int scull_sort_count(struct scull_sort *dev) {
+    return dev->wp - dev->rp;
+}
+
+// sorts the unread elements and returns the first of them
+//  does not take a lock, assumes caller is holding one
+const char *scull_sort_peek(struct scull_sort *dev) {
+    sort_runs_merge(dev);
+    return dev->rp;
+}
+
+// number of unread elements no greater than value
+//  does not take a lock, assumes caller is holding one
+unsigned int scull_sort_count_upto(struct scull_sort *dev, char value) {
+    return sort_index_below(dev, SORT_KEY(value) + 1);
+}
+
+// drops the first count elements, as found by scull_sort_peek
+//  does not take a lock, assumes caller is holding one
+// Writers waiting for room are woken here, so that reads through scullmerge
+//  make room as well; they get the lock once the caller drops it.
+void scull_sort_consume(struct scull_sort *dev, unsigned int count) {
+    sort_index_drop(dev, dev->rp, count);
+    dev->rp += count;
+    dev->nruns = (dev->rp != dev->wp);
+    dev->runs[0].len = dev->wp - dev->rp;
+    if (count)
+        wake_up_interruptible(&dev->outq);
 }
 
 
@@ -264,7 +948,13 @@ static int scull_sort_fasync(int fd, struct file *filp, int mode) {
 //=============================================================================
 
 long scull_sort_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
-	int err = 0;
+	int err = 0, val = 0;
+	long retval = 0;
+	struct scull_sort_range range;
+	struct scull_sort_readmode rmode;
+	struct scull_sort_snapshot snap;
+	struct scull_sort_file *sfile = filp->private_data;
+	struct scull_sort *dev = sfile->dev;
     
 	/*
 	 * extract the type and number bitfields, and don't decode
@@ -287,14 +977,137 @@ long scull_sort_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 
 	switch(cmd) {
 	  case SCULL_IOCRESET:
-	    mutex_lock(&my_dev.mutex);
+	    mutex_lock(&dev->mutex);
 		    printk("\n=== Resetting scullsort device! ===\n");
-		    my_dev.rp = my_dev.wp = my_dev.buffer;
-		    my_dev.nreaders = my_dev.nwriters = 0;
-		    sort_sorted = false;
-		mutex_unlock(&my_dev.mutex);
+		    dev->rp = dev->wp = dev->buffer;
+		    dev->nreaders = dev->nwriters = 0;
+		    dev->nruns = 0;
+		    memset(dev->index, 0, sizeof(dev->index));
+		mutex_unlock(&dev->mutex);
 		break;
-        
+
+	  case SCULL_SORT_IOCQCOUNT:
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		retval = dev->wp - dev->rp;
+		mutex_unlock(&dev->mutex);
+		return retval;
+
+	  case SCULL_SORT_IOCXKTH:
+	  case SCULL_SORT_IOCXRANK:
+	  case SCULL_SORT_IOCXQUANTILE:
+		if (__get_user(val, (int __user *)arg))
+			return -EFAULT;
+		/* fall through */
+	  case SCULL_SORT_IOCGMIN:
+	  case SCULL_SORT_IOCGMAX:
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		retval = sort_query(dev, cmd, &val);
+		mutex_unlock(&dev->mutex);
+		if (retval == 0)
+			retval = __put_user(val, (int __user *)arg);
+		return retval;
+
+	  case SCULL_SORT_IOCXRANGE:
+		if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+			return -EFAULT;
+		if (!sort_value_ok(range.lo) || !sort_value_ok(range.hi))
+			return -EINVAL;
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		range.count = 0;
+		if (SORT_KEY(range.lo) <= SORT_KEY(range.hi))
+			range.count = sort_index_below(dev, SORT_KEY(range.hi) + 1)
+			            - sort_index_below(dev, SORT_KEY(range.lo));
+		mutex_unlock(&dev->mutex);
+		if (copy_to_user((void __user *)arg, &range, sizeof(range)))
+			return -EFAULT;
+		break;
+
+	  case SCULL_SORT_IOCSREADMODE:
+		if (copy_from_user(&rmode, (void __user *)arg, sizeof(rmode)))
+			return -EFAULT;
+		switch (rmode.mode) {
+		  case SCULL_SORT_READ_RANGE:
+			if (!sort_value_ok(rmode.lo) || !sort_value_ok(rmode.hi) ||
+			    SORT_KEY(rmode.lo) > SORT_KEY(rmode.hi))
+				return -EINVAL;
+			/* fall through */
+		  case SCULL_SORT_READ_ALL:
+		  case SCULL_SORT_READ_UNIQUE:
+		  case SCULL_SORT_READ_PAIRS:
+			break;
+		  default:
+			return -EINVAL;
+		}
+		/* per file, but a read on the same file may be using them */
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		if (rmode.mode == SCULL_SORT_READ_RANGE) {
+			sfile->lo = SORT_KEY(rmode.lo);
+			sfile->hi = SORT_KEY(rmode.hi);
+		}
+		sfile->mode = rmode.mode;
+		mutex_unlock(&dev->mutex);
+		break;
+
+	  case SCULL_SORT_IOCTWFLAGS: /* per file, so no lock needed */
+		if (arg & ~SCULL_SORT_WRITE_RUN)
+			return -EINVAL;
+		sfile->wflags = arg;
+		break;
+
+	  case SCULL_SORT_IOCQWFLAGS:
+		return sfile->wflags;
+
+	  case SCULL_SORT_IOCXEXPORT:
+		if (copy_from_user(&snap, (void __user *)arg, sizeof(snap)))
+			return -EFAULT;
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		retval = sort_snap_export(dev, &snap);
+		mutex_unlock(&dev->mutex);
+		if (retval == 0 || retval == -ENOSPC)
+			if (copy_to_user((void __user *)arg, &snap, sizeof(snap)))
+				return -EFAULT;
+		return retval;
+
+	  case SCULL_SORT_IOCSIMPORT:
+		if (copy_from_user(&snap, (void __user *)arg, sizeof(snap)))
+			return -EFAULT;
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		retval = sort_snap_import(dev, &snap);
+		if (!retval && dev->eventfd)
+			eventfd_signal(dev->eventfd, scull_sort_count(dev));
+		mutex_unlock(&dev->mutex);
+		if (retval)
+			return retval;
+		wake_up_interruptible(&dev->inq);
+		scull_merge_wake();
+		if (dev->async_queue)
+			kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+		break;
+
+	  case SCULL_IOCTEVENTFD:
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		retval = scull_set_eventfd(&dev->eventfd, (int)arg);
+		mutex_unlock(&dev->mutex);
+		return retval;
+
+	  case SCULL_SORT_IOCGREADMODE:
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		rmode.mode = sfile->mode;
+		rmode.lo = SORT_VALUE(sfile->lo);
+		rmode.hi = SORT_VALUE(sfile->hi);
+		mutex_unlock(&dev->mutex);
+		if (copy_to_user((void __user *)arg, &rmode, sizeof(rmode)))
+			return -EFAULT;
+		break;
+
 	  default:
 		printk("\nERROR: scullsort device cannot understand IOCTL: %d\n", cmd);
 		return -EINVAL;
@@ -311,55 +1124,71 @@ long scull_sort_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 struct file_operations scull_sort_fops = {
     .owner          = THIS_MODULE,
     .llseek         = no_llseek,
-    .read           = scull_sort_read,
-    .write          = scull_sort_write,
+    .read_iter      = scull_sort_read_iter,
+    .write_iter     = scull_sort_write_iter,
     .poll           = scull_sort_poll,
     .unlocked_ioctl = scull_sort_ioctl,
     .open           = scull_sort_open,
     .release        = scull_sort_release,
     .fasync         = scull_sort_fasync,
+    .splice_read    = scull_sort_splice_read,
+    .splice_write   = scull_sort_splice_write,
 };
 
 
 
 int scull_sort_init(dev_t firstdev) {
-    int result;
+    struct scull_sort *dev;
+    int result, i;
     printk("\n=== Initializing scullsort ===\n");
 
     if (sort_initialized) {
         printk(KERN_ALERT "ERROR: Already initialized!\n");
     }
 
-    // register device    
-    result = register_chrdev_region(firstdev, 1, "sculls");
+    // register devices
+    result = register_chrdev_region(firstdev, scull_sort_nr_devs, "sculls");
     if (result < 0) {
         printk(KERN_NOTICE "Unable to register sculls region: %d\n", result);
         return 0;
     }
-    
-    // initialize queues for readers and writers
-    init_waitqueue_head(&(my_dev.inq));
-    init_waitqueue_head(&(my_dev.outq));
-    
-    // initialize the per-device mutex (only one since reads modify)
-    mutex_init(&(my_dev.mutex));
-    
-    // configure cdev entry
     scull_sort_devno = firstdev;
-    cdev_init(&(my_dev.cdev), &scull_sort_fops);
-    my_dev.cdev.owner = THIS_MODULE;
-    result = cdev_add(&(my_dev.cdev), scull_sort_devno, 1);
+    scull_sort_devices = kzalloc(scull_sort_nr_devs * sizeof(struct scull_sort),
+                                 GFP_KERNEL);
+    if (!scull_sort_devices) {
+        unregister_chrdev_region(firstdev, scull_sort_nr_devs);
+        return 0;
+    }
     
-    // scull_sort member data
-    my_dev.buffersize   = sort_buffer;
-    my_dev.buffer       = kzalloc(sort_buffer, GFP_KERNEL);
-    my_dev.end = my_dev.buffer + my_dev.buffersize;
-    my_dev.wp = my_dev.rp = my_dev.buffer;
-    my_dev.nreaders = my_dev.nwriters = 0;
+    for (i = 0; i < scull_sort_nr_devs; i++) {
+        dev = &scull_sort_devices[i];
+        
+        // initialize queues for readers and writers
+        init_waitqueue_head(&(dev->inq));
+        init_waitqueue_head(&(dev->outq));
+        
+        // initialize the per-device mutex (only one since reads modify)
+        mutex_init(&(dev->mutex));
+        
+        // scull_sort member data
+        dev->buffersize   = sort_buffer;
+        dev->buffer       = kzalloc(sort_buffer, GFP_KERNEL);
+        dev->scratch      = kmalloc(sort_buffer, GFP_KERNEL);
+        dev->end = dev->buffer + dev->buffersize;
+        dev->wp = dev->rp = dev->buffer;
+        dev->nreaders = dev->nwriters = 0;
+        
+        // configure cdev entry
+        cdev_init(&(dev->cdev), &scull_sort_fops);
+        dev->cdev.owner = THIS_MODULE;
+        result = cdev_add(&(dev->cdev), scull_sort_devno + i, 1);
+        if (result)
+            printk(KERN_NOTICE "Error %d adding scullsort%d\n", result, i);
+    }
     
     sort_initialized = true;
     
-    return 1;
+    return scull_sort_nr_devs;
 }
 
 
@@ -367,16 +1196,26 @@ int scull_sort_init(dev_t firstdev) {
 //This is called by cleanup_module or on failure.
 //  It is required to never fail, even if nothing was initialized first
 void scull_sort_cleanup(void) {
+    int i;
     printk("Cleaning up scullsort\n");
     
-    // remove cdev entry
-    cdev_del(&my_dev.cdev);
+    if (!scull_sort_devices)
+        return;
     
-    // free buffer
-    kfree(my_dev.buffer);
+    for (i = 0; i < scull_sort_nr_devs; i++) {
+        // remove cdev entry
+        cdev_del(&scull_sort_devices[i].cdev);
+        
+        // free buffers
+        kfree(scull_sort_devices[i].buffer);
+        kfree(scull_sort_devices[i].scratch);
+        scull_set_eventfd(&scull_sort_devices[i].eventfd, -1);
+    }
+    kfree(scull_sort_devices);
+    scull_sort_devices = NULL;
     
-    // unregister device
-    unregister_chrdev_region(scull_sort_devno, 1);
+    // unregister devices
+    unregister_chrdev_region(scull_sort_devno, scull_sort_nr_devs);
 }
 
 
@@ -384,48 +1223,50 @@ void scull_sort_cleanup(void) {
 
 // prints some info to help with debugging
 //  acquires the lock itself, so do not call inside locked section
-void print_stuff(void) {
-    mutex_lock(&my_dev.mutex);
+void print_stuff(struct scull_sort *dev) {
+    mutex_lock(&dev->mutex);
 
     printk( "\tBuffer size: %d  \n"
             "\tFilled:      %ld \n"
             "\tHidden:      %ld \n"
+            "\tRuns:        %d  \n"
             "\tReaders:     %d  \n"
             "\tWriters:     %d  \n",
-            my_dev.buffersize,
-            my_dev.wp - my_dev.rp,
-            my_dev.rp - my_dev.buffer,
-            my_dev.nreaders,
-            my_dev.nwriters
+            dev->buffersize,
+            dev->wp - dev->rp,
+            dev->rp - dev->buffer,
+            dev->nruns,
+            dev->nreaders,
+            dev->nwriters
     );
     
-    mutex_unlock(&my_dev.mutex);
+    mutex_unlock(&dev->mutex);
 }
 
 // cleans up wasted space in the buffer
 //  does not take a lock, assumes caller is holding one 
-void scull_shift_buffer(void) {
+void scull_shift_buffer(struct scull_sort *dev) {
     int dist, count, i;
 
-    if (my_dev.rp > my_dev.wp) {
+    if (dev->rp > dev->wp) {
         printk("Something went horribly wrong!\n");
         return;
     }
-    if (my_dev.rp == my_dev.buffer) {
+    if (dev->rp == dev->buffer) {
         printk("No shifting needed\n");
         return;
     }
     
-    dist    = my_dev.rp - my_dev.buffer;
-    count   = my_dev.wp - my_dev.rp;
+    dist    = dev->rp - dev->buffer;
+    count   = dev->wp - dev->rp;
     printk("Shifting %d buffer elements by %d spaces\n", count, dist);
 
     for (i=0; i<count; i++) {
-        *(my_dev.buffer + i) = *(my_dev.rp + i);
+        *(dev->buffer + i) = *(dev->rp + i);
     }
     
-    my_dev.rp = my_dev.buffer;
-    my_dev.wp -= dist;
+    dev->rp = dev->buffer;
+    dev->wp -= dist;
 }
 
 
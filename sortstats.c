@@ -0,0 +1,53 @@
+// This code is structured in the same way as the sculltest test program so as
+//  to provide some sense of continuity. This program prints order statistics
+//  of whatever is waiting in the scullsort device, without consuming it.
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include "scull.h"
+
+int main() {
+    int fd, count, val;
+    struct scull_sort_range range = { 'a', 'z', 0 };
+
+    if ((fd = open ("/dev/scullsort", O_RDONLY)) == -1) {
+        perror("sortstats opening file");
+        return -1;
+    }
+
+    if ((count = ioctl(fd, SCULL_SORT_IOCQCOUNT)) < 0) {
+        perror("sortstats counting");
+        return -1;
+    }
+    fprintf (stdout, "\nsortstats: %d elements\n", count);
+    if (count == 0) {
+        close(fd);
+        return 0;
+    }
+
+    if (ioctl(fd, SCULL_SORT_IOCGMIN, &val) == 0)
+        fprintf (stdout, "    min  '%c'\n", val);
+    if (ioctl(fd, SCULL_SORT_IOCGMAX, &val) == 0)
+        fprintf (stdout, "    max  '%c'\n", val);
+
+    val = 500;
+    if (ioctl(fd, SCULL_SORT_IOCXQUANTILE, &val) == 0)
+        fprintf (stdout, "    p50  '%c'\n", val);
+    val = 990;
+    if (ioctl(fd, SCULL_SORT_IOCXQUANTILE, &val) == 0)
+        fprintf (stdout, "    p99  '%c'\n", val);
+
+    val = 'm';
+    if (ioctl(fd, SCULL_SORT_IOCXRANK, &val) == 0)
+        fprintf (stdout, "    %d elements below 'm'\n", val);
+    if (ioctl(fd, SCULL_SORT_IOCXRANGE, &range) == 0)
+        fprintf (stdout, "    %u elements in ['a', 'z']\n", range.count);
+
+    close(fd);
+
+    return 0;
+}